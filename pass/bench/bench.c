@@ -0,0 +1,111 @@
+// Benchmark harness: bench <n> [reps]
+// Runs the kernel it is linked with on a problem of size n and prints one CSV row:
+// kernel,n,seconds,gflops,l1_misses,llc_misses,checksum
+// Time and miss counts are those of the fastest of reps runs. Miss counts are left empty when
+// perf_event is not available (e.g. perf_event_paranoid too high, or inside a container).
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int open_cache_counter(uint64_t cache)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counter(int fd)
+{
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static long long stop_counter(int fd)
+{
+    long long count;
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+static void print_count(long long count)
+{
+    if (count >= 0)
+        printf(",%lld", count);
+    else
+        printf(",");
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <n> [reps]\n", argv[0]);
+        return 2;
+    }
+    long n = atol(argv[1]);
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    if (n <= 0 || reps <= 0) {
+        fprintf(stderr, "%s: n and reps must be positive\n", argv[0]);
+        return 2;
+    }
+
+    int l1 = open_cache_counter(PERF_COUNT_HW_CACHE_L1D);
+    int llc = open_cache_counter(PERF_COUNT_HW_CACHE_LL);
+    double best = -1;
+    long long best_l1 = -1, best_llc = -1;
+    double checksum = 0;
+    for (int r = 0; r < reps; r++) {
+        // Fresh data for every run: kernels that update their data in place always do the same work
+        void *data = BenchKernel.setup(n);
+        start_counter(l1);
+        start_counter(llc);
+        double start = now();
+        BenchKernel.run(n, data);
+        double elapsed = now() - start;
+        long long l1_misses = stop_counter(l1);
+        long long llc_misses = stop_counter(llc);
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+            best_l1 = l1_misses;
+            best_llc = llc_misses;
+        }
+        checksum = BenchKernel.checksum(n, data);
+        BenchKernel.teardown(data);
+    }
+
+    double flops = BenchKernel.flops(n);
+    printf("%s,%ld,%.6f,", BenchKernel.name, n, best);
+    if (flops > 0)
+        printf("%.3f", flops / best * 1e-9);
+    print_count(best_l1);
+    print_count(best_llc);
+    printf(",%.10g\n", checksum);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef LOOPBLOCKING_BENCH_H
+#define LOOPBLOCKING_BENCH_H
+
+#include <stdlib.h>
+
+// Interface between the benchmark harness (bench.c) and a kernel.
+// Every kernel file defines one BenchKernel and is compiled to IR, so that only its code goes through the pass.
+struct bench_kernel
+{
+    const char *name;
+    // Allocates and initializes the data of a problem of size n
+    void *(*setup)(long n);
+    // Runs the kernel once: this is the only part that is timed
+    void (*run)(long n, void *data);
+    // Floating point operations of one run, 0 if the kernel only moves data
+    double (*flops)(long n);
+    // Sum of the results, to check that the blocked kernel computes the same values
+    double (*checksum)(long n, void *data);
+    void (*teardown)(void *data);
+};
+
+extern const struct bench_kernel BenchKernel;
+
+// Array of count doubles with deterministic values in [0, 1)
+static inline double *bench_array(long count, unsigned seed)
+{
+    double *a = malloc(count * sizeof(double));
+    for (long i = 0; i < count; i++)
+        a[i] = (double)((i * 2654435761u + seed) % 1000) / 1000;
+    return a;
+}
+
+static inline double bench_sum(const double *a, long count)
+{
+    double sum = 0;
+    for (long i = 0; i < count; i++)
+        sum += a[i];
+    return sum;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Compile time of the pass on generated modules with many loop nests: prints one CSV row per module size, with the time
+# of opt without and with the pass (same pipeline as run.sh) and the time spent in the pass alone (-time-passes).
+# Usually run through "make compile-bench", which sets the tools; uses OPT, PASS, BUILD_DIR, BENCH_REPS, BENCH_PASS_FLAGS
+# as run.sh, and:
+#   COMPILE_NESTS           nests in each module (default: "1000 2000 4000"), half GEMM and half transpose
+#   COMPILE_FUNCTION_NESTS  nests in each function of the module (default: 50)
+#   COMPILE_SINGLE_NESTS    nests of the modules with a single function (default: "250 500 1000"): the cost of the pass
+#                           must also grow linearly with the nests of a function. default<O2> is left out of both times,
+#                           its own passes do not scale with the size of one function.
+#   COMPILE_SIZE            trip count of every loop (default: 512, large enough for the cache model to block every nest)
+import os
+import re
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+OPT = os.environ.get("OPT", "opt")
+PASS = os.environ.get("PASS", os.path.join(BENCH_DIR, "..", "LoopBlocking.so"))
+BUILD_DIR = os.environ.get("BUILD_DIR", os.path.join(BENCH_DIR, "..", "obj", "bench"))
+NESTS = [int(n) for n in os.environ.get("COMPILE_NESTS", "1000 2000 4000").split()]
+FUNCTION_NESTS = int(os.environ.get("COMPILE_FUNCTION_NESTS", "50"))
+SINGLE_NESTS = [int(n) for n in os.environ.get("COMPILE_SINGLE_NESTS", "250 500 1000").split()]
+SIZE = int(os.environ.get("COMPILE_SIZE", "512"))
+REPS = int(os.environ.get("BENCH_REPS", "3"))
+PASS_FLAGS = os.environ.get("BENCH_PASS_FLAGS", "").split()
+
+# Same pipeline as run.sh
+PREPARE = "sroa,early-cse<memssa>,instcombine,simplifycfg,loop(loop-rotate),loop-simplify,lcssa"
+
+
+def element(name, array, row, col):
+    # Address of array[row][col] of a SIZE x SIZE row-major matrix
+    return ["  %{0}.idx = mul nsw i64 {1}, {2}".format(name, row, SIZE),
+            "  %{0}.idx2 = add nsw i64 %{0}.idx, {1}".format(name, col),
+            "  %{0} = getelementptr inbounds double, double* %{1}, i64 %{0}.idx2".format(name, array)]
+
+
+def gemm(name, iv):
+    # C[i][j] += A[i][k] * B[k][j]
+    return (element(name + ".a", "A", iv[0], iv[2]) + element(name + ".b", "B", iv[2], iv[1]) +
+            element(name + ".c", "C", iv[0], iv[1]) +
+            ["  %{0}.va = load double, double* %{0}.a".format(name),
+             "  %{0}.vb = load double, double* %{0}.b".format(name),
+             "  %{0}.vc = load double, double* %{0}.c".format(name),
+             "  %{0}.mul = fmul double %{0}.va, %{0}.vb".format(name),
+             "  %{0}.add = fadd double %{0}.vc, %{0}.mul".format(name),
+             "  store double %{0}.add, double* %{0}.c".format(name)])
+
+
+def transpose(name, iv):
+    # B[j][i] = A[i][j]
+    return (element(name + ".a", "A", iv[0], iv[1]) + element(name + ".b", "B", iv[1], iv[0]) +
+            ["  %{0}.va = load double, double* %{0}.a".format(name),
+             "  store double %{0}.va, double* %{0}.b".format(name)])
+
+
+def loop_nest(name, depth, body, entry, exit):
+    # Loops tested in the header, as clang emits them: the pipeline rotates them before the pass runs
+    iv = ["%{0}.iv{1}".format(name, d) for d in range(depth)]
+    lines = []
+    for d in range(depth):
+        pred = entry if d == 0 else "{0}.h{1}".format(name, d - 1)
+        inside = "{0}.h{1}".format(name, d + 1) if d + 1 < depth else name + ".body"
+        after = exit if d == 0 else "{0}.l{1}".format(name, d - 1)
+        lines += ["{0}.h{1}:".format(name, d),
+                  "  {0} = phi i64 [ 0, %{1} ], [ {0}.next, %{2}.l{3} ]".format(iv[d], pred, name, d),
+                  "  %{0}.c{1} = icmp slt i64 {2}, {3}".format(name, d, iv[d], SIZE),
+                  "  br i1 %{0}.c{1}, label %{2}, label %{3}".format(name, d, inside, after)]
+    lines += [name + ".body:"] + body(name, iv) + ["  br label %{0}.l{1}".format(name, depth - 1)]
+    for d in reversed(range(depth)):
+        lines += ["{0}.l{1}:".format(name, d),
+                  "  {0}.next = add nsw i64 {0}, 1".format(iv[d]),
+                  "  br label %{0}.h{1}".format(name, d)]
+    return lines
+
+
+def module(nests, function_nests):
+    lines = []
+    for f in range(0, nests, function_nests):
+        count = min(function_nests, nests - f)
+        lines += ["define void @kernels{0}(double* noalias %A, double* noalias %B, double* noalias %C) {{".format(f // function_nests),
+                  "entry:", "  br label %n0.h0"]
+        for n in range(count):
+            name = "n{0}".format(n)
+            exit = "n{0}.h0".format(n + 1) if n + 1 < count else "return"
+            if n % 2:
+                lines += loop_nest(name, 2, transpose, "entry" if n == 0 else "n{0}.h0".format(n - 1), exit)
+            else:
+                lines += loop_nest(name, 3, gemm, "entry" if n == 0 else "n{0}.h0".format(n - 1), exit)
+        lines += ["return:", "  ret void", "}", ""]
+    return "\n".join(lines)
+
+
+def opt(source, pipeline, flags):
+    return subprocess.run([OPT, "-load=" + PASS, "-load-pass-plugin=" + PASS, "-passes=" + pipeline, "-blk-position=none", "-disable-output"] +
+                          flags + [source], check=True, stderr=subprocess.PIPE, universal_newlines=True).stderr
+
+
+def opt_time(source, pipeline, flags):
+    # Fastest of REPS runs
+    best = None
+    for _ in range(REPS):
+        start = time.perf_counter()
+        opt(source, pipeline, flags)
+        seconds = time.perf_counter() - start
+        best = seconds if best is None else min(best, seconds)
+    return best
+
+
+def pass_time(source, pipeline, flags):
+    # Wall time, the last column of -time-passes, summed over the functions
+    total = 0.0
+    for line in opt(source, pipeline, ["-time-passes"] + flags).splitlines():
+        if line.rstrip().endswith("LoopBlockingPass"):
+            total += float(re.findall(r"([0-9.]+) \(\s*[0-9.]+%\)", line)[-1])
+    return total
+
+
+def measure(nests, function_nests, pipeline):
+    source = os.path.join(BUILD_DIR, "nests{0}x{1}.ll".format(nests, function_nests))
+    with open(source, "w") as f:
+        f.write(module(nests, function_nests))
+    blocking = "function(" + PREPARE + ",custom-loopblocking)" + pipeline
+    base = opt_time(source, "function(" + PREPARE + ")" + pipeline, [])
+    blocked = opt_time(source, blocking, PASS_FLAGS)
+    print("{0},{1},{2:.3f},{3:.3f},{4:.2f},{5:.3f}".format(nests, -(-nests // function_nests), base, blocked, blocked / base,
+                                                         pass_time(source, blocking, PASS_FLAGS)))
+    sys.stdout.flush()
+
+
+def main():
+    os.makedirs(BUILD_DIR, exist_ok=True)
+    print("nests,functions,base_seconds,blocked_seconds,overhead,pass_seconds")
+    for nests in NESTS:
+        measure(nests, FUNCTION_NESTS, ",default<O2>")
+    for nests in SINGLE_NESTS:
+        measure(nests, nests, "")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,54 @@
+// Valid 2D convolution of an n x n image with a CONV2D_K x CONV2D_K filter
+#include "bench.h"
+
+#define CONV2D_K 5
+
+struct conv2d_data
+{
+    double *In, *W, *Out;
+};
+
+void conv2d(long n, double In[restrict n][n], double W[restrict CONV2D_K][CONV2D_K], double Out[restrict n][n])
+{
+    for (long i = 0; i < n - CONV2D_K + 1; i++)
+        for (long j = 0; j < n - CONV2D_K + 1; j++)
+            for (long p = 0; p < CONV2D_K; p++)
+                for (long q = 0; q < CONV2D_K; q++)
+                    Out[i][j] += In[i + p][j + q] * W[p][q];
+}
+
+static void *setup(long n)
+{
+    struct conv2d_data *d = malloc(sizeof(*d));
+    d->In = bench_array(n * n, 1);
+    d->W = bench_array(CONV2D_K * CONV2D_K, 2);
+    d->Out = bench_array(n * n, 3);
+    return d;
+}
+
+static void run(long n, void *data)
+{
+    struct conv2d_data *d = data;
+    conv2d(n, (double (*)[n])d->In, (double (*)[CONV2D_K])d->W, (double (*)[n])d->Out);
+}
+
+static double flops(long n)
+{
+    return 2.0 * CONV2D_K * CONV2D_K * (n - CONV2D_K + 1) * (n - CONV2D_K + 1);
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(((struct conv2d_data *)data)->Out, n * n);
+}
+
+static void teardown(void *data)
+{
+    struct conv2d_data *d = data;
+    free(d->In);
+    free(d->W);
+    free(d->Out);
+    free(d);
+}
+
+const struct bench_kernel BenchKernel = {"conv2d", setup, run, flops, checksum, teardown};
@@ -0,0 +1,51 @@
+// C += A * B
+#include "bench.h"
+
+struct gemm_data
+{
+    double *A, *B, *C;
+};
+
+void gemm(long n, double A[restrict n][n], double B[restrict n][n], double C[restrict n][n])
+{
+    for (long i = 0; i < n; i++)
+        for (long j = 0; j < n; j++)
+            for (long k = 0; k < n; k++)
+                C[i][j] += A[i][k] * B[k][j];
+}
+
+static void *setup(long n)
+{
+    struct gemm_data *d = malloc(sizeof(*d));
+    d->A = bench_array(n * n, 1);
+    d->B = bench_array(n * n, 2);
+    d->C = bench_array(n * n, 3);
+    return d;
+}
+
+static void run(long n, void *data)
+{
+    struct gemm_data *d = data;
+    gemm(n, (double (*)[n])d->A, (double (*)[n])d->B, (double (*)[n])d->C);
+}
+
+static double flops(long n)
+{
+    return 2.0 * n * n * n;
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(((struct gemm_data *)data)->C, n * n);
+}
+
+static void teardown(void *data)
+{
+    struct gemm_data *d = data;
+    free(d->A);
+    free(d->B);
+    free(d->C);
+    free(d);
+}
+
+const struct bench_kernel BenchKernel = {"gemm", setup, run, flops, checksum, teardown};
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Builds every kernel with and without the pass and prints one CSV row per kernel, problem size and tile size.
+# Usually run through "make bench", which sets the tools; the sweep is configured with:
+#   BENCH_KERNELS     kernels to run (default: all of them)
+#   BENCH_SIZES       problem sizes, overriding the default ones of each kernel
+#   BENCH_TILES       blocking factors passed with -blk-f; "model" leaves the choice to the cache model
+#   BENCH_REPS        runs of each binary, the fastest one is reported
+#   BENCH_CFLAGS      flags used to compile the kernels (e.g. -march=native)
+#   BENCH_PASS_FLAGS  other options of the pass (e.g. -blk-levels=2 or -blk-parallel)
+#   BENCH_TUNING_DB   database written by tune.py: adds the "tuned" tile, with the factors read from it
+# Blocking does not change the order of the operations on each element: a blocked row whose checksum differs from the
+# one of base is reported on stderr, and the script fails once the sweep is complete.
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CLANG=${CLANG:-clang}
+OPT=${OPT:-opt}
+LLC=${LLC:-llc}
+PASS=${PASS:-$BENCH_DIR/../LoopBlocking.so}
+RUNTIME=${RUNTIME:-$BENCH_DIR/../libLoopBlockingRT.a}
+BUILD_DIR=${BUILD_DIR:-$BENCH_DIR/../obj/bench}
+BENCH_KERNELS=${BENCH_KERNELS:-"gemm transpose stencil2d stencil3d conv2d trisolve"}
+BENCH_TILES=${BENCH_TILES:-"model 16 32 64"}
+if [ -n "$BENCH_TUNING_DB" ]; then
+    BENCH_TILES="$BENCH_TILES tuned"
+fi
+BENCH_REPS=${BENCH_REPS:-3}
+BENCH_CFLAGS=${BENCH_CFLAGS:-"-O2 -march=native"}
+
+# Default sizes: from a working set that fits in the L2 to one well beyond the LLC
+default_sizes()
+{
+    case $1 in
+        gemm|trisolve) echo "256 512 1024 2048" ;;
+        transpose|stencil2d|conv2d) echo "512 1024 2048 4096" ;;
+        stencil3d) echo "64 128 256 384" ;;
+    esac
+}
+
+# The same canonicalization runs with and without the pass, so that the two versions only differ by the blocking
+PREPARE="sroa,early-cse<memssa>,instcombine,simplifycfg,loop(loop-rotate),loop-simplify,lcssa"
+
+mkdir -p "$BUILD_DIR"
+"$CLANG" $BENCH_CFLAGS -c "$BENCH_DIR/bench.c" -o "$BUILD_DIR/bench.o"
+
+# build <kernel> <variant> <pipeline> [pass options...]
+build()
+{
+    local kernel=$1 variant=$2 pipeline=$3
+    shift 3
+    # -blk-position=none: default<O2> would otherwise block the nests again, even in the base variant
+    "$OPT" -load="$PASS" -load-pass-plugin="$PASS" -passes="function($pipeline),default<O2>" -blk-position=none "$@" \
+        "$BUILD_DIR/$kernel.bc" -o "$BUILD_DIR/$kernel.$variant.bc"
+    "$LLC" -O2 -filetype=obj -relocation-model=pic "$BUILD_DIR/$kernel.$variant.bc" -o "$BUILD_DIR/$kernel.$variant.o"
+    "$CLANG" "$BUILD_DIR/$kernel.$variant.o" "$BUILD_DIR/bench.o" "$RUNTIME" -lstdc++ -pthread -o "$BUILD_DIR/$kernel.$variant"
+}
+
+echo "variant,tile,kernel,n,seconds,gflops,l1_misses,llc_misses,checksum,speedup"
+wrong=0
+for kernel in $BENCH_KERNELS; do
+    # Only the optimizations of the pipeline above run on the kernel
+    "$CLANG" $BENCH_CFLAGS -Xclang -disable-llvm-passes -emit-llvm -c "$BENCH_DIR/$kernel.c" -o "$BUILD_DIR/$kernel.bc"
+    build "$kernel" base "$PREPARE"
+    for tile in $BENCH_TILES; do
+        if [ "$tile" = model ]; then
+            build "$kernel" "blocked.$tile" "$PREPARE,custom-loopblocking" $BENCH_PASS_FLAGS
+        elif [ "$tile" = tuned ]; then
+            build "$kernel" "blocked.$tile" "$PREPARE,custom-loopblocking" -blk-tuning-db="$BENCH_TUNING_DB" $BENCH_PASS_FLAGS
+        else
+            build "$kernel" "blocked.$tile" "$PREPARE,custom-loopblocking" -blk-f="$tile" $BENCH_PASS_FLAGS
+        fi
+    done
+
+    for n in ${BENCH_SIZES:-$(default_sizes "$kernel")}; do
+        base=$("$BUILD_DIR/$kernel.base" "$n" "$BENCH_REPS")
+        base_time=$(echo "$base" | cut -d, -f3)
+        base_checksum=$(echo "$base" | cut -d, -f7)
+        echo "base,-,$base,1.00"
+        for tile in $BENCH_TILES; do
+            row=$("$BUILD_DIR/$kernel.blocked.$tile" "$n" "$BENCH_REPS")
+            echo "blocked,$tile,$row,$(echo "$row" | awk -F, -v base="$base_time" '{ printf "%.2f", base / $3 }')"
+            checksum=$(echo "$row" | cut -d, -f7)
+            if [ "$checksum" != "$base_checksum" ]; then
+                echo "$kernel n=$n tile=$tile: checksum $checksum differs from the base one $base_checksum" >&2
+                wrong=$((wrong + 1))
+            fi
+        done
+    done
+done
+if [ $wrong -gt 0 ]; then
+    echo "$wrong blocked rows computed wrong results" >&2
+    exit 1
+fi
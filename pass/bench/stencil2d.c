@@ -0,0 +1,40 @@
+// Gauss-Seidel sweeps of a 5-point stencil, updated in place: the dependences along t, i and j
+// have negative components, so the nest is blocked after skewing
+#include "bench.h"
+
+#define STENCIL2D_STEPS 16
+
+void stencil2d(long n, double A[restrict n][n])
+{
+    for (long t = 0; t < STENCIL2D_STEPS; t++)
+        for (long i = 1; i < n - 1; i++)
+            for (long j = 1; j < n - 1; j++)
+                A[i][j] = 0.2 * (A[i - 1][j] + A[i][j - 1] + A[i][j] + A[i][j + 1] + A[i + 1][j]);
+}
+
+static void *setup(long n)
+{
+    return bench_array(n * n, 1);
+}
+
+static void run(long n, void *data)
+{
+    stencil2d(n, (double (*)[n])data);
+}
+
+static double flops(long n)
+{
+    return 5.0 * STENCIL2D_STEPS * (n - 2) * (n - 2);
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(data, n * n);
+}
+
+static void teardown(void *data)
+{
+    free(data);
+}
+
+const struct bench_kernel BenchKernel = {"stencil2d", setup, run, flops, checksum, teardown};
@@ -0,0 +1,50 @@
+// One Jacobi sweep of a 7-point stencil: blocking along j and k keeps the planes i - 1, i and i + 1 of A in cache
+#include "bench.h"
+
+struct stencil3d_data
+{
+    double *A, *B;
+};
+
+void stencil3d(long n, double A[restrict n][n][n], double B[restrict n][n][n])
+{
+    for (long i = 1; i < n - 1; i++)
+        for (long j = 1; j < n - 1; j++)
+            for (long k = 1; k < n - 1; k++)
+                B[i][j][k] = 0.125 * (A[i - 1][j][k] + A[i][j - 1][k] + A[i][j][k - 1] + 2 * A[i][j][k]
+                                      + A[i][j][k + 1] + A[i][j + 1][k] + A[i + 1][j][k]);
+}
+
+static void *setup(long n)
+{
+    struct stencil3d_data *d = malloc(sizeof(*d));
+    d->A = bench_array(n * n * n, 1);
+    d->B = bench_array(n * n * n, 2);
+    return d;
+}
+
+static void run(long n, void *data)
+{
+    struct stencil3d_data *d = data;
+    stencil3d(n, (double (*)[n][n])d->A, (double (*)[n][n])d->B);
+}
+
+static double flops(long n)
+{
+    return 8.0 * (n - 2) * (n - 2) * (n - 2);
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(((struct stencil3d_data *)data)->B, n * n * n);
+}
+
+static void teardown(void *data)
+{
+    struct stencil3d_data *d = data;
+    free(d->A);
+    free(d->B);
+    free(d);
+}
+
+const struct bench_kernel BenchKernel = {"stencil3d", setup, run, flops, checksum, teardown};
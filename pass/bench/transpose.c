@@ -0,0 +1,48 @@
+// B = A^T: no reuse inside a row, but blocks keep the lines of B written by consecutive rows of A in cache
+#include "bench.h"
+
+struct transpose_data
+{
+    double *A, *B;
+};
+
+void transpose(long n, double A[restrict n][n], double B[restrict n][n])
+{
+    for (long i = 0; i < n; i++)
+        for (long j = 0; j < n; j++)
+            B[j][i] = A[i][j];
+}
+
+static void *setup(long n)
+{
+    struct transpose_data *d = malloc(sizeof(*d));
+    d->A = bench_array(n * n, 1);
+    d->B = bench_array(n * n, 2);
+    return d;
+}
+
+static void run(long n, void *data)
+{
+    struct transpose_data *d = data;
+    transpose(n, (double (*)[n])d->A, (double (*)[n])d->B);
+}
+
+static double flops(long n)
+{
+    return 0;
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(((struct transpose_data *)data)->B, n * n);
+}
+
+static void teardown(void *data)
+{
+    struct transpose_data *d = data;
+    free(d->A);
+    free(d->B);
+    free(d);
+}
+
+const struct bench_kernel BenchKernel = {"transpose", setup, run, flops, checksum, teardown};
@@ -0,0 +1,53 @@
+// Forward substitution L X = B with n right-hand sides, L unit lower triangular: X overwrites B.
+// The bound of j depends on i, so the nest is blocked as a non-rectangular one
+#include "bench.h"
+
+struct trisolve_data
+{
+    double *L, *X;
+};
+
+void trisolve(long n, double L[restrict n][n], double X[restrict n][n])
+{
+    for (long i = 0; i < n; i++)
+        for (long j = 0; j < i; j++)
+            for (long k = 0; k < n; k++)
+                X[i][k] -= L[i][j] * X[j][k];
+}
+
+static void *setup(long n)
+{
+    struct trisolve_data *d = malloc(sizeof(*d));
+    // Small entries below the diagonal keep X bounded
+    d->L = bench_array(n * n, 1);
+    for (long i = 0; i < n * n; i++)
+        d->L[i] /= n;
+    d->X = bench_array(n * n, 2);
+    return d;
+}
+
+static void run(long n, void *data)
+{
+    struct trisolve_data *d = data;
+    trisolve(n, (double (*)[n])d->L, (double (*)[n])d->X);
+}
+
+static double flops(long n)
+{
+    return 1.0 * n * n * (n - 1);
+}
+
+static double checksum(long n, void *data)
+{
+    return bench_sum(((struct trisolve_data *)data)->X, n * n);
+}
+
+static void teardown(void *data)
+{
+    struct trisolve_data *d = data;
+    free(d->L);
+    free(d->X);
+    free(d);
+}
+
+const struct bench_kernel BenchKernel = {"trisolve", setup, run, flops, checksum, teardown};
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Empirical tuning of the blocking factors: for every nest of the kernels, builds and times the kernel with each
+# combination of factors in TUNE_SPACE and writes the fastest one to the database read by -blk-tuning-db.
+# Usually run through "make tune", which sets the tools; uses the same variables as run.sh, and:
+#   TUNING_DB   database to update (default: tuning.json); entries of nests that are not tuned are kept
+#   TUNE_SPACE  factors tried for each blocked loop (default: "16 32 64 128"); leaving the nest unblocked is always tried
+#   TUNE_SIZE   problem size to tune for, overriding the default one of each kernel
+# The nests are tuned one at a time: the others use the factors already in the database, or the cache model.
+# A variant whose checksum differs from the one of the kernel with no nest blocked computes wrong results: it is dropped.
+import itertools
+import json
+import os
+import subprocess
+import sys
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+CLANG = os.environ.get("CLANG", "clang")
+OPT = os.environ.get("OPT", "opt")
+LLC = os.environ.get("LLC", "llc")
+PASS = os.environ.get("PASS", os.path.join(BENCH_DIR, "..", "LoopBlocking.so"))
+RUNTIME = os.environ.get("RUNTIME", os.path.join(BENCH_DIR, "..", "libLoopBlockingRT.a"))
+BUILD_DIR = os.environ.get("BUILD_DIR", os.path.join(BENCH_DIR, "..", "obj", "bench"))
+KERNELS = os.environ.get("BENCH_KERNELS", "gemm transpose stencil2d stencil3d conv2d trisolve").split()
+REPS = os.environ.get("BENCH_REPS", "3")
+CFLAGS = os.environ.get("BENCH_CFLAGS", "-O2 -march=native").split()
+PASS_FLAGS = os.environ.get("BENCH_PASS_FLAGS", "").split()
+TUNING_DB = os.environ.get("TUNING_DB", "tuning.json")
+SPACE = [int(size) for size in os.environ.get("TUNE_SPACE", "16 32 64 128").split()]
+
+# Large enough not to fit in the LLC, small enough to time many variants
+DEFAULT_SIZES = {"gemm": 1024, "trisolve": 1024, "transpose": 4096, "stencil2d": 2048, "conv2d": 2048, "stencil3d": 256}
+
+# Same pipeline as run.sh
+PREPARE = "sroa,early-cse<memssa>,instcombine,simplifycfg,loop(loop-rotate),loop-simplify,lcssa"
+
+
+def opt(kernel, output, flags):
+    return subprocess.run([OPT, "-load=" + PASS, "-load-pass-plugin=" + PASS,
+                           "-passes=function(" + PREPARE + ",custom-loopblocking),default<O2>", "-blk-position=none"] + flags + PASS_FLAGS +
+                          [os.path.join(BUILD_DIR, kernel + ".bc")] + output,
+                          check=True, stderr=subprocess.PIPE, universal_newlines=True).stderr
+
+
+def list_nests(kernel):
+    # Nests the pass blocks with the cache model, with their number of blocked loops
+    nests = []
+    for line in opt(kernel, ["-disable-output"], ["-blk-tuning-list"]).splitlines():
+        if line.startswith("{"):
+            nests.append(json.loads(line))
+    return nests
+
+
+def time_variant(kernel, db, n):
+    db_file = os.path.join(BUILD_DIR, kernel + ".tuning.json")
+    with open(db_file, "w") as f:
+        json.dump(db, f)
+    bc = os.path.join(BUILD_DIR, kernel + ".tuning.bc")
+    obj = os.path.join(BUILD_DIR, kernel + ".tuning.o")
+    binary = os.path.join(BUILD_DIR, kernel + ".tuning")
+    opt(kernel, ["-o", bc], ["-blk-tuning-db=" + db_file])
+    subprocess.run([LLC, "-O2", "-filetype=obj", "-relocation-model=pic", bc, "-o", obj], check=True)
+    subprocess.run([CLANG, obj, os.path.join(BUILD_DIR, "bench.o"), RUNTIME, "-lstdc++", "-pthread", "-o", binary], check=True)
+    row = subprocess.run([binary, str(n), REPS], check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout.strip()
+    # kernel,n,seconds,gflops,l1_misses,llc_misses,checksum (see bench.c)
+    fields = row.split(",")
+    return float(fields[2]), fields[6]
+
+
+def main():
+    db = {"nests": {}}
+    if os.path.exists(TUNING_DB):
+        with open(TUNING_DB) as f:
+            db = json.load(f)
+    os.makedirs(BUILD_DIR, exist_ok=True)
+    subprocess.run([CLANG] + CFLAGS + ["-c", os.path.join(BENCH_DIR, "bench.c"), "-o", os.path.join(BUILD_DIR, "bench.o")],
+                   check=True)
+
+    for kernel in KERNELS:
+        n = int(os.environ.get("TUNE_SIZE", DEFAULT_SIZES[kernel]))
+        subprocess.run([CLANG] + CFLAGS + ["-Xclang", "-disable-llvm-passes", "-emit-llvm", "-c",
+                                           os.path.join(BENCH_DIR, kernel + ".c"), "-o", os.path.join(BUILD_DIR, kernel + ".bc")],
+                       check=True)
+        nests = list_nests(kernel)
+        # Blocking does not change the order of the operations on each element: the checksums must be equal
+        unblocked = {"nests": {nest["id"]: {"sizes": [0] * nest["loops"]} for nest in nests}}
+        _, base_checksum = time_variant(kernel, unblocked, n)
+        for nest in nests:
+            best = None
+            for sizes in itertools.chain([[0] * nest["loops"]], itertools.product(SPACE, repeat=nest["loops"])):
+                variant = json.loads(json.dumps(db))
+                variant["nests"][nest["id"]] = {"sizes": list(sizes)}
+                seconds, checksum = time_variant(kernel, variant, n)
+                if checksum != base_checksum:
+                    print("%s n=%d sizes=%s: checksum %s differs from the unblocked %s, dropped" %
+                          (nest["id"], n, list(sizes), checksum, base_checksum), file=sys.stderr)
+                    continue
+                print("%s n=%d sizes=%s: %.6f s" % (nest["id"], n, list(sizes), seconds), file=sys.stderr)
+                if best is None or seconds < best[1]:
+                    best = (list(sizes), seconds)
+            if best is None:
+                print("%s: every variant computes wrong results, not tuned" % nest["id"])
+                continue
+            db["nests"][nest["id"]] = {"sizes": best[0], "seconds": best[1], "n": n}
+            print("%s: best sizes %s (model: %s)" % (nest["id"], best[0], nest["sizes"]))
+            # Written after every nest, so that an interrupted run keeps what it found
+            with open(TUNING_DB, "w") as f:
+                json.dump(db, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
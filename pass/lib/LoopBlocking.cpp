@@ -10,10 +10,13 @@
 #include <llvm/Analysis/DomTreeUpdater.h>
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/LoopNestAnalysis.h>
+#include <llvm/Analysis/MustExecute.h>
 #include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/IR/Instruction.h>
 #include <llvm/IR/Instructions.h>
@@ -28,12 +31,29 @@
 #include <llvm/Analysis/LoopCacheAnalysis.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/CodeMetrics.h>
+#include <llvm/Analysis/BasicAliasAnalysis.h>
+#include <llvm/Analysis/GlobalsModRef.h>
+#include <llvm/Analysis/ScalarEvolutionAliasAnalysis.h>
 #include <llvm/Analysis/DependenceAnalysis.h>
 #include <llvm/IR/IntrinsicInst.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/CodeExtractor.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
+#include <llvm/Transforms/Utils/UnrollLoop.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <functional>
 #include <memory>
 
 using namespace llvm;
@@ -41,7 +61,89 @@ using namespace llvm;
 
 static cl::opt<unsigned> BlockingFactor(
     "blk-f", cl::init(16), cl::Hidden, 
-    cl::desc("Specify the L1 data cache size in bytes"));
+    cl::desc("Specify the blocking factor, overriding the one computed by the cache model"));
+
+static cl::list<unsigned> BlockingSizes(
+    "blk-sizes", cl::CommaSeparated, cl::Hidden,
+    cl::desc("Specify the blocking factor of each blocked loop, outermost first (e.g. -blk-sizes=64,8,256). "
+             "Loops without an entry use -blk-f"));
+
+static cl::opt<unsigned> CacheLevels(
+    "blk-levels", cl::init(1), cl::Hidden,
+    cl::desc("Number of cache levels to block for, starting from L1 (at most " + std::to_string(MAX_CACHE_LEVELS) + ")"));
+
+static cl::list<unsigned> CacheSizes(
+    "blk-cache-sizes", cl::CommaSeparated, cl::Hidden,
+    cl::desc("Size in bytes of each data cache level, starting from L1 (e.g. -blk-cache-sizes=49152,1310720). "
+             "Levels without an entry use the size reported by the target, or the default one"));
+
+static cl::opt<bool> ReorderLoops(
+    "blk-reorder", cl::init(true), cl::Hidden,
+    cl::desc("Order blocking loops and loops inside a block by their cache cost"));
+
+static cl::opt<bool> SplitFullTiles(
+    "blk-full-tiles", cl::init(true), cl::Hidden,
+    cl::desc("Run blocks that are not cut by the loop bounds in a copy of the nest with constant trip counts"));
+
+static cl::opt<bool> UnrollAndJam(
+    "blk-unroll-jam", cl::init(false), cl::Hidden,
+    cl::desc("Unroll-and-jam the loops inside full blocks to reuse values in registers (requires -blk-full-tiles)"));
+
+static cl::opt<unsigned> UnrollAndJamFactor(
+    "blk-unroll-jam-f", cl::init(0), cl::Hidden,
+    cl::desc("Specify the unroll-and-jam factor, overriding the one computed from the register file"));
+
+static cl::opt<bool> Pack(
+    "blk-pack", cl::init(false), cl::Hidden,
+    cl::desc("Copy the block of an array whose rows map to the same cache sets to a contiguous buffer on the stack, "
+             "accessed by the loops inside the block in its place, and copy it back if they write it"));
+
+static cl::opt<bool> Prefetch(
+    "blk-prefetch", cl::init(false), cl::Hidden,
+    cl::desc("Prefetch the block the innermost blocking loop visits next while the loops inside the current block run"));
+
+static cl::opt<unsigned> PrefetchDistance(
+    "blk-prefetch-distance", cl::Hidden,
+    cl::desc("Specify the prefetch distance in instructions, overriding the one of the target"));
+
+static cl::opt<bool> Parallel(
+    "blk-parallel", cl::init(false), cl::Hidden,
+    cl::desc("Run the iterations of the outermost blocking loop in parallel, when they are independent. "
+             "The loop body is outlined and passed to lb_parallel_for, provided by the LoopBlockingRT runtime"));
+
+static cl::opt<bool> Skew(
+    "blk-skew", cl::init(true), cl::Hidden,
+    cl::desc("Skew nests whose dependences have constant distances with negative components, so that they can be blocked"));
+
+static cl::opt<bool> Wavefront(
+    "blk-wavefront", cl::init(false), cl::Hidden,
+    cl::desc("Visit the blocks of a skewed nest by anti-diagonals, whose blocks are independent "
+             "(with -blk-parallel they run in parallel)"));
+
+static cl::opt<bool> RuntimeChecks(
+    "blk-runtime-checks", cl::init(true), cl::Hidden,
+    cl::desc("Keep a copy of the original nest, run instead of the blocked one when the trip counts unknown at compile time "
+             "are too small for blocking to pay off, or when arrays the dependence analysis cannot tell apart overlap"));
+
+static cl::opt<bool> PrepareNests(
+    "blk-prepare", cl::init(true), cl::Hidden,
+    cl::desc("Hoist invariant code and bounds out of loop nests and sink the rest into inner loops, "
+             "so that nearly-perfect nests can be blocked"));
+
+static cl::opt<std::string> TuningDB(
+    "blk-tuning-db", cl::Hidden, cl::value_desc("file"),
+    cl::desc("Read the blocking factors of each nest from a JSON database written by bench/tune.py, "
+             "{\"nests\": {\"<nest id>\": {\"sizes\": [64, 8, 256]}}}, instead of computing them with the cache model"));
+
+static cl::opt<bool> TuningList(
+    "blk-tuning-list", cl::init(false), cl::Hidden,
+    cl::desc("Print to stderr one JSON line per nest with a blocking factor: its ID, the number of blocked loops and their factors"));
+
+static cl::opt<int> HotCutoff(
+    "blk-hot-cutoff", cl::init(990000), cl::Hidden,
+    cl::desc("With profile data, block only the nests whose innermost loop header is hot for this percentile of the "
+             "profile summary, in parts per million (990000: the blocks that make up 99% of the execution count); "
+             "0 blocks every nest"));
 
 static cl::opt<unsigned> MaxPerfectNestDepth(
     "max-nest-depth", cl::init(3), cl::Hidden,
@@ -51,11 +153,135 @@ static cl::opt<unsigned> FirstLoopDepth(
     "first-depth", cl::init(0), cl::Hidden,
     cl::desc("Specify the depth of the first loop to block, sarting from the root at level 0."));
 
+// Where the default pipelines (-O2, -O3) run the loop nest pass
+enum class BlockingPosition { None, LoopOptimizerEnd, VectorizerStart };
+
+static cl::opt<BlockingPosition> Position(
+    "blk-position", cl::init(BlockingPosition::VectorizerStart), cl::Hidden,
+    cl::desc("Position of the pass in the default -O2 and -O3 pipelines"),
+    cl::values(clEnumValN(BlockingPosition::None, "none", "not run by the default pipelines"),
+               clEnumValN(BlockingPosition::LoopOptimizerEnd, "loop-optimizer-end",
+                          "after the loop simplification passes, with the last loop passes of the function simplification pipeline"),
+               clEnumValN(BlockingPosition::VectorizerStart, "vectorizer-start",
+                          "after the inliner and the loop passes, right before the loop vectorizer")));
+
 STATISTIC(CandidateLoops, "Candidate loops");
 STATISTIC(TransformedLoops, "Loops transformed");
 STATISTIC(InvalidLoops, "Invalid loops");
 STATISTIC(FoundRotated, "How many times a loop in rotated form was encountered");
 STATISTIC(BoundsNotDominant, "Candidate loop bounds did not dominate its Parent's header");
+STATISTIC(IllegalDependences, "Nests not blocked because of loop-carried dependences");
+STATISTIC(LiveOutValues, "Nests not blocked because values computed inside are used outside");
+STATISTIC(ColdNests, "Nests not blocked because the profile finds them cold");
+STATISTIC(NotProfitable, "Nests for which the cache model found no profitable blocking factor");
+STATISTIC(FullTileVersions, "Nests with a separate copy for full blocks");
+STATISTIC(UnrolledAndJammed, "Full blocks whose loops were unrolled-and-jammed");
+STATISTIC(PackedArrays, "Blocks of arrays copied to a contiguous buffer");
+STATISTIC(Prefetches, "Prefetches of the next block inserted in the loops inside the blocks");
+STATISTIC(ParallelBlockingLoops, "Blocking loops outlined to run in parallel");
+STATISTIC(HoistedInstructions, "Instructions between loop headers hoisted to make a nest perfect");
+STATISTIC(SunkInstructions, "Instructions between loop headers sunk into the inner loop to make a nest perfect");
+STATISTIC(HoistedBounds, "Loop bounds hoisted to the preheader of the nest");
+STATISTIC(VersionedNests, "Nests blocked under run time checks on trip counts or overlapping arrays");
+STATISTIC(RuntimeAliasChecks, "Pairs of accesses checked for overlap at run time");
+STATISTIC(SkewedNests, "Nests skewed to make them fully permutable");
+STATISTIC(WavefrontNests, "Skewed nests whose blocks are visited by anti-diagonals");
+
+// Blocking grows the code: it is left out of -O1 and of the pipelines optimizing for size
+static bool isBlockingLevel(OptimizationLevel Level)
+{
+    return Level.getSpeedupLevel() >= 2 && Level.getSizeLevel() == 0;
+}
+
+// Functions created by the pass: they are not considered for blocking again
+static const char *OutlinedAttr = "loop-blocking-outlined";
+// Entry point of the runtime: void lb_parallel_for(int64_t lb, int64_t ub, int64_t step, void (*fn)(int64_t, void*), void *ctx)
+static const char *ParallelForName = "lb_parallel_for";
+
+// Blocking factors of the nests in the -blk-tuning-db database, by nest ID. Read once per process.
+static StringMap<SmallVector<unsigned, MAX_NEST_SIZE>> const& getTuningDB()
+{
+    static StringMap<SmallVector<unsigned, MAX_NEST_SIZE>> DB = [] {
+        StringMap<SmallVector<unsigned, MAX_NEST_SIZE>> Entries;
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(TuningDB);
+        if (!Buffer) {
+            errs() << "warning: cannot read the tuning database " << TuningDB << ": " << Buffer.getError().message() << '\n';
+            return Entries;
+        }
+        Expected<json::Value> Root = json::parse((*Buffer)->getBuffer());
+        if (!Root) {
+            errs() << "warning: invalid tuning database " << TuningDB << ": " << toString(Root.takeError()) << '\n';
+            return Entries;
+        }
+        const json::Object *Nests = Root->getAsObject() ? Root->getAsObject()->getObject("nests") : nullptr;
+        if (!Nests) {
+            errs() << "warning: no \"nests\" object in the tuning database " << TuningDB << '\n';
+            return Entries;
+        }
+        for (auto const& Nest : *Nests) {
+            const json::Object *Entry = Nest.second.getAsObject();
+            const json::Array *Sizes = Entry ? Entry->getArray("sizes") : nullptr;
+            if (!Sizes || Sizes->empty() || Sizes->size() > MAX_NEST_SIZE)
+                continue;
+            SmallVector<unsigned, MAX_NEST_SIZE> Factors;
+            for (json::Value const& Size : *Sizes) {
+                Optional<int64_t> Factor = Size.getAsInteger();
+                if (!Factor || *Factor < 0 || *Factor > UINT32_MAX)
+                    break;
+                Factors.push_back(*Factor);
+            }
+            if (Factors.size() == Sizes->size())
+                Entries[Nest.first.str()] = std::move(Factors);
+        }
+        return Entries;
+    }();
+    return DB;
+}
+
+// Per-loop control of the blocking through the llvm.loop.tile.* attributes used by Polly and #pragma clang loop:
+// enable (i1) and size (i32) set the blocking factor of a loop; the followup attributes give the loop ID
+// of the blocking loops (floor) and of the loops inside the blocks (tile)
+static const char *TileEnableAttr = "llvm.loop.tile.enable";
+static const char *TileSizeAttr = "llvm.loop.tile.size";
+static const char *TileFollowupAll = "llvm.loop.tile.followup_all";
+static const char *TileFollowupFloor = "llvm.loop.tile.followup_floor";
+static const char *TileFollowupTile = "llvm.loop.tile.followup_tile";
+
+static TransformationMode hasTilingTransformation(const Loop *L)
+{
+    Optional<bool> Enable = getOptionalBoolLoopAttribute(L, TileEnableAttr);
+    if (Enable && !*Enable)
+        return TM_SuppressedByUser;
+    if (Enable || getOptionalIntLoopAttribute(L, TileSizeAttr))
+        return TM_ForcedByUser;
+    if (hasDisableAllTransformsHint(L))
+        return TM_Disable;
+    return TM_Unspecified;
+}
+
+// Loop ID of a loop created or copied by the pass: the Followup attributes of the original loop if it has them,
+// otherwise the original attributes (when Inherit) with the tiling ones replaced by a marker that keeps the loop
+// from being blocked again
+static void setTiledLoopID(Loop *L, MDNode *OrigID, const char *Followup, bool Inherit)
+{
+    if (Followup) {
+        if (Optional<MDNode*> FollowupID = makeFollowupLoopID(OrigID, {TileFollowupAll, Followup})) {
+            if (*FollowupID)
+                L->setLoopID(*FollowupID);
+            return;
+        }
+    }
+    LLVMContext &Ctx = L->getHeader()->getContext();
+    MDNode *Disable = MDNode::get(Ctx, {MDString::get(Ctx, TileEnableAttr), ConstantAsMetadata::get(ConstantInt::getFalse(Ctx))});
+    L->setLoopID(makePostTransformationMetadata(Ctx, Inherit ? OrigID : nullptr, {"llvm.loop.tile."}, {Disable}));
+}
+
+// A loop inside a block can be skipped by a branch from its preheader to its exit when the exit has no phis
+static bool canGuardLoop(Loop *L)
+{
+    BasicBlock *Exit = L->getExitBlock();
+    return Exit && !isa<PHINode>(Exit->front());
+}
 
 
 
@@ -64,17 +290,54 @@ bool LoopBlocking::execute()
     /*analyze loop forest to find possible candidates to block*/
     std::vector<Loop*> const &LoopsVector = LI.getTopLevelLoops();
     /*collect all candidate loops*/
+    bool Changed = false;
+    if (PrepareNests)
+        for (Loop *L : LoopsVector)
+            Changed |= prepareNest(L);
     LLVM_DEBUG(dbgs() << "Collecting loops...\n");
     SmallVector<BlockingNest> Nests = collectCandidates(LoopsVector);
+    PadExits = true;
+    OutlineParallel = true;
+    Changed |= transformNests(Nests);
+    if (!ExitPads.empty())
+        removeExitPads();
+
+    // Outlining is done last: it leaves LoopInfo out of date
+    for (BlockingLevel const& P : ParallelLoops) {
+        if (outlineParallelLoop(P)) {
+            ParallelBlockingLoops++;
+            OutlinedLoops = true;
+        }
+    }
+
+    return Changed;
+}
+
+bool LoopBlocking::execute(Loop &Root, unsigned Slot)
+{
+    // Only the nests inside Root are considered: the loop pass manager visits the other top-level loops on its own
+    assert(Root.isOutermost() && "Not the root of a loop nest");
+    assert(LI.getTopLevelLoops()[Slot] == &Root && "Wrong position of the root of the nest");
+    bool Changed = PrepareNests && prepareNest(&Root);
+    Loop *Top = &Root;
+    SmallVector<BlockingNest> Nests = collectCandidates(Top, Slot);
+    // Outlining would move the nest to another function, behind the back of the loop pass manager:
+    // OutlineParallel is not set, and no blocking loop is queued in ParallelLoops
+    Changed |= transformNests(Nests);
+    return Changed;
+}
+
+bool LoopBlocking::transformNests(MutableArrayRef<BlockingNest> Nests)
+{
     bool Changed = false;
     for (BlockingNest& N : Nests) {
-        if ((Changed |= transform(N))) {
+        if (transform(N)) {
             LLVM_DEBUG(dbgs() << "Candidate successfully transofrmed.\n");
             TransformedLoops++;
+            Changed = true;
         }
     }
-
-    return Changed;
+    return Changed || Modified;
 }
 
 bool LoopBlocking::transform(BlockingNest& BN)
@@ -86,111 +349,1556 @@ bool LoopBlocking::transform(BlockingNest& BN)
     //      - Candidate preheader contains just the terminator instruction;
     //      - Candidate exit block contains just the terminator instruction;
     //      - Candidate exit block and Parent latch are adjacent;
-    //      - the Value used to check the Candidate bounds dominates the Parent header block.
+    //      - the Value used to check the Candidate bounds dominates the header of the nest;
+    //      - no value computed in the nest is used outside of it;
+    //      - the nest is fully permutable: no dependence has a negative component along the nest loops.
 
     if (FirstLoopDepth < 0 || FirstLoopDepth >= BN.size()) {
         LLVM_DEBUG(dbgs() << "First loop depth out of range. Aborting.\n");
+        remarkMissed(BN, "FirstDepthOutOfRange", "-first-depth is not a loop of the nest");
+        return false;
+    }
+
+    if (!BN.areAllLoopsSimplified()) {
+        LLVM_DEBUG(dbgs() << "Not all loops are in simplified form!\n");
+        remarkMissed(BN, "NotSimplified", "not all loops of the nest are in simplified form");
+        return false;
+    }
+
+    if (!BN.areAllLoopsRotated()) {
+        LLVM_DEBUG(dbgs() << "Not all loops are in rotated form!\n");
+        remarkMissed(BN, "NotRotated", "not all loops of the nest are in rotated form");
+        return false;
+    }
+
+    // Loops created by the pass are marked as such
+    if (std::all_of(BN.begin() + FirstLoopDepth, BN.end(), [](Loop *L) { return hasTilingTransformation(L) & TM_Disable; })) {
+        LLVM_DEBUG(dbgs() << "Loop metadata disables blocking for every loop of the nest.\n");
+        remarkMissed(BN, "DisabledByMetadata", "loop metadata disables blocking for every loop of the nest");
+        return false;
+    }
+
+    if (isColdNest(BN)) {
+        LLVM_DEBUG(dbgs() << "The profile finds the nest cold.\n");
+        ColdNests++;
+        remarkMissed(BN, "ColdNest", "the profile finds the nest cold");
+        return false;
+    }
+
+    SmallVector<BlockedLoop, MAX_NEST_SIZE> Band;
+    // Finally check dominance for bounds
+    for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++) {
+        Loop *L = BN[Depth];
+        Optional<Loop::LoopBounds> Bounds = L->getBounds(SE);
+        if (!Bounds) {
+            LLVM_DEBUG(dbgs() << "Loop: " << L->getName() << "bounds info could not be computed!\n");
+            remarkMissed(L, "UnknownBounds", "the bounds of a loop of the nest could not be computed");
+            return false;
+        }
+        // Bounds computed inside the nest only from values available before it are moved to its preheader
+        if (PrepareNests) {
+            bool Hoisted = false;
+            BN.topLoop()->makeLoopInvariant(&Bounds->getInitialIVValue(), Hoisted);
+            BN.topLoop()->makeLoopInvariant(&Bounds->getFinalIVValue(), Hoisted);
+            if (Hoisted) {
+                LLVM_DEBUG(dbgs() << "Loop: " << L->getName() << ": bounds hoisted to the preheader of the nest\n");
+                SE.forgetValue(&Bounds->getInitialIVValue());
+                SE.forgetValue(&Bounds->getFinalIVValue());
+                HoistedBounds++;
+                Modified = true;
+            }
+        }
+        // Blocking loops are created around the whole nest: bounds must be available before it,
+        // or be computed from the IV of an outer loop of the band (checked once the loop is added to it)
+        bool Dominant = checkBoundaryValuesDominance(*Bounds, BN.topLoop()->getHeader(), DT, SE);
+        if ((*Bounds).getDirection() == Loop::LoopBounds::Direction::Unknown) {
+            LLVM_DEBUG(dbgs() << "Loop: " <<  L->getName() << ": direction unknown\n");
+            remarkMissed(L, "UnknownDirection", "the direction of a loop of the nest is unknown");
+            return false;
+        }
+        // The blocking loop steps by a whole block of iterations of the target loop:
+        // the step has to be known at compile time for the blocks to line up with the iteration space.
+        if ((*Bounds).getDirection() != Loop::LoopBounds::Direction::Increasing || !isa_and_nonnull<ConstantInt>((*Bounds).getStepValue())) {
+            LLVM_DEBUG(dbgs() << "Loop: " <<  L->getName() << ": step is not a positive constant\n");
+            remarkMissed(L, "NonConstantStep", "the step of a loop of the nest is not a positive constant");
+            return false;
+        }
+        Optional<CmpInst::Predicate> Pred = getBlockingPredicate(*Bounds, BN.topLoop());
+        if (!Pred) {
+            LLVM_DEBUG(dbgs() << "Loop: " <<  L->getName() << ": exit condition cannot be turned into an ordered comparison\n");
+            remarkMissed(L, "UnsupportedExitCondition", "the exit condition of a loop of the nest is not an ordered comparison");
+            return false;
+        }
+        Band.emplace_back(L, Depth, std::move(*Bounds), *Pred);
+        Band.back().IV = L->getInductionVariable(SE);
+        if (unsigned TripC = SE.getSmallConstantTripCount(L))
+            Band.back().EstimatedTripCount = TripC;
+        else
+            Band.back().EstimatedTripCount = getLoopEstimatedTripCount(L);
+        if (!Dominant && !getAffineBounds(Band, BN.topLoop())) {
+            LLVM_DEBUG(dbgs() << "Loop: " << L->getName() << "bounds do not dominate parent header!\n");
+            BoundsNotDominant++;
+            remarkMissed(L, "BoundsNotDominant", "the bounds of a loop are computed inside the nest and are not affine in an outer loop");
+            return false;
+        }
+    }
+    bool NonRectangular = any_of(Band, [](BlockedLoop const& BL) { return BL.BoundDepth.hasValue(); });
+
+    if (hasValuesLiveOut(BN)) {
+        LLVM_DEBUG(dbgs() << "Values computed in the nest are used outside of it!\n");
+        LiveOutValues++;
+        remarkMissed(BN, "LiveOutValues", "values computed in the nest are used after it");
+        return false;
+    }
+
+    SmallVector<bool, MAX_NEST_SIZE> Carried;
+    SmallVector<AccessPair, 4> AliasChecks;
+    bool Skewed = false;
+    if (!checkDependences(BN, Carried, AliasChecks)) {
+        // Dependences with constant distances can be made non-negative by skewing the inner loops of the band
+        Skewed = Skew && !NonRectangular && computeSkewFactors(BN, Band);
+        if (!Skewed) {
+            LLVM_DEBUG(dbgs() << "Dependences prevent blocking the nest!\n");
+            IllegalDependences++;
+            if (!Skew)
+                remarkMissed(BN, "IllegalDependences", "dependences prevent blocking the nest, and skewing is disabled");
+            else if (NonRectangular)
+                remarkMissed(BN, "IllegalDependences", "dependences prevent blocking the nest, and non-rectangular nests are not skewed");
+            else
+                remarkMissed(BN, "IllegalDependences", "dependences prevent blocking the nest, even after skewing");
+            return false;
+        }
+        LLVM_DEBUG(dbgs() << "Dependences require skewing the nest.\n");
+    }
+
+    Optional<BlockingInfo> Info = blockingAnalysis(BN);
+    if (!Info) {
+        LLVM_DEBUG(dbgs() << "No profitable blocking factor for the nest.\n");
+        NotProfitable++;
+        remarkMissed(BN, "NotProfitable", "no profitable blocking factor: the data of the nest fits in the cache, or no loop is blocked");
+        return false;
+    }
+
+    if (Skewed && any_of(Band, [&](BlockedLoop const& BL) { return !Info->getBlockingFactor(BL.Depth); })) {
+        LLVM_DEBUG(dbgs() << "Skewing requires blocking all the loops of the nest.\n");
+        IllegalDependences++;
+        remarkMissed(BN, "IllegalDependences", "the nest must be skewed, which requires blocking all of its loops");
+        return false;
+    }
+
+    // Run the original nest when blocking does not pay off or is not legal for the values known at run time
+    bool Versioned = false;
+    if (RuntimeChecks && (!AliasChecks.empty() || Info->getMinBlockedTripCount())) {
+        if (versionNest(BN, *Info, AliasChecks)) {
+            VersionedNests++;
+            RuntimeAliasChecks += AliasChecks.size();
+            Versioned = true;
+        } else if (!AliasChecks.empty()) {
+            LLVM_DEBUG(dbgs() << "Accesses to different objects cannot be checked at run time!\n");
+            IllegalDependences++;
+            remarkMissed(BN, "UncheckedAliasing", "accesses to arrays that may overlap cannot be checked at run time");
+            return false;
+        }
+    }
+
+    // Blocks along the outermost blocking loop can run in parallel if no dependence crosses them
+    Optional<unsigned> OutermostDepth = Info->getOutermostBlockedLoop();
+    bool RunsInParallel = Parallel && OutlineParallel && !Skewed && !NonRectangular && OutermostDepth && !Carried[*OutermostDepth];
+
+    // The addresses are analyzed on the loops of the band before they are blocked.
+    // A buffer in the frame of the function would be shared by the blocks that run in parallel.
+    SmallVector<PackedArray, 4> Packed;
+    if (Pack && !Skewed && !NonRectangular && !RunsInParallel)
+        Packed = selectPackedArrays(BN, Band, *Info, AliasChecks, Versioned);
+
+    Loop *TopLoop = BN.topLoop();
+    unsigned NumPrefetches = 0;
+
+    // Skewed and non-rectangular blocks are expressed along the original order of the loops, for a single level of blocks:
+    // the blocking loop of a loop is inside the ones of the loops its bounds depend on
+    ArrayRef<unsigned> Order = Info->getLoopOrder();
+    unsigned NumLevels = Info->getNumLevels();
+    SmallVector<unsigned, MAX_NEST_SIZE> OriginalOrder;
+    if (Skewed || NonRectangular) {
+        for (BlockedLoop const& BL : Band)
+            OriginalOrder.push_back(BL.Depth);
+        Order = OriginalOrder;
+        NumLevels = 1;
+        Info->setCacheCosts(Info->getOriginalCost(), Info->getOriginalCost());
+    }
+
+    // All the legality checks are complete, now we can create the new blocking loops.
+    // They are created from the innermost one: the first blocked loop in the chosen order ends up outermost.
+    // The blocking loops of a cache level wrap around the ones of the level below.
+    BlockedLoop *Outermost = nullptr;
+    for (unsigned Level = 0; Level < NumLevels; Level++) {
+        for (auto it = Order.rbegin(); it != Order.rend(); it++) {
+            BlockedLoop &Target = Band[*it - FirstLoopDepth];
+            unsigned Factor = Info->getBlockingFactor(Target.Depth, Level);
+            // A block as large as the one of the level below would be iterated once
+            if (!Factor || (!Target.Levels.empty() && Target.Levels.back().Factor == Factor))
+                continue;
+            LLVM_DEBUG(dbgs() << "Considering loop (level " << Level + 1 << "): \n"; Target.L->print(dbgs().indent(4), false, false););
+            Loop* BlockingLoop = createBlockingLoop(Target, TopLoop, Factor);
+            insertBlockingLoop(BlockingLoop, TopLoop, BN.getSlot());
+            SE.forgetLoop(Target.L);
+            TopLoop = BlockingLoop;
+            Outermost = &Target;
+            #ifndef NDEBUG
+            BlockingLoop->verifyLoop();
+            #endif
+        }
+    }
+    if (TopLoop != BN.topLoop())
+        updateDominatorTree(TopLoop, BN.topLoop());
+
+    if (NonRectangular)
+        boundNonRectangularBlocks(Band);
+
+    // Loops inside a block follow the same order as the blocking loops
+    SmallVector<unsigned, MAX_NEST_SIZE> BandOrder;
+    for (unsigned Depth : Order)
+        BandOrder.push_back(Depth - FirstLoopDepth);
+
+    if (Skewed) {
+        annotateBlockedLoops(Band, BandOrder);
+        // Dependences cross the blocks along every loop: only the anti-diagonals of blocks are independent
+        skewBlocks(Band);
+        SE.forgetLoop(TopLoop);
+        SkewedNests++;
+        if (Wavefront) {
+            BlockingLevel Diagonal = createWavefront(Band);
+            SE.forgetLoop(TopLoop);
+            WavefrontNests++;
+            if (Parallel && OutlineParallel)
+                ParallelLoops.push_back(Diagonal);
+        }
+    } else {
+        // The accesses are rewritten before the loops are permuted, which replaces their IVs, and before the copy for full blocks
+        for (PackedArray const& PA : Packed)
+            packArray(PA, Band, BN.topLoop());
+        if (!Packed.empty()) {
+            SE.forgetLoop(TopLoop);
+            PackedArrays += Packed.size();
+        }
+
+        if (permuteLoops(Band, BandOrder)) {
+            SE.forgetLoop(BN.topLoop());
+        } else {
+            Info->setCacheCosts(Info->getOriginalCost(), Info->getOriginalCost());
+            for (unsigned I = 0; I < BandOrder.size(); I++)
+                BandOrder[I] = I;
+        }
+        // Before the copy for full blocks is made, so that it gets the same attributes
+        annotateBlockedLoops(Band, BandOrder);
+
+        if (RunsInParallel) {
+            assert(Outermost && Outermost->Depth == *OutermostDepth && "Outermost blocking loop not predicted");
+            ParallelLoops.push_back(Outermost->Levels.back());
+        }
+
+        // The bounds of a full block of a non-rectangular loop change with the outer IVs
+        Loop *FullNest = nullptr;
+        if (SplitFullTiles && !NonRectangular) {
+            FullNest = versionFullTiles(Band, BN.topLoop());
+            if (FullNest) {
+                FullTileVersions++;
+                if (UnrollAndJam && unrollAndJamBlock(FullNest))
+                    UnrolledAndJammed++;
+            }
+        }
+
+        // Last, since unroll-and-jam does not handle calls in the nest
+        if (Prefetch) {
+            NumPrefetches = insertPrefetches(Band, BN.topLoop());
+            if (FullNest)
+                NumPrefetches += insertPrefetches(Band, FullNest);
+            Prefetches += NumPrefetches;
+        }
+    }
+    
+    remarkBlocked(BN, Band, *Info, NumLevels, Skewed, Versioned, Packed.size(), NumPrefetches);
+
+    // Both walk the whole function: checking them after every nest is quadratic in the number of nests
+    if (VerifyLoopInfo)
+        LI.verify(DT);
+    if (VerifyDomInfo)
+        assert(DT.verify() && "DomTree is broken!");
+
+    return true;
+}
+
+void LoopBlocking::remarkMissed(BlockingNest &BN, StringRef Name, StringRef Msg)
+{
+    remarkMissed(BN.topLoop(), Name, Msg);
+}
+
+void LoopBlocking::remarkMissed(Loop *L, StringRef Name, StringRef Msg)
+{
+    ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, Name, L->getStartLoc(), L->getHeader()) << "loop nest not blocked: " << Msg;
+    });
+}
+
+void LoopBlocking::remarkBlocked(BlockingNest &BN, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info, unsigned NumLevels,
+                                 bool Skewed, bool Versioned, unsigned NumPacked, unsigned NumPrefetches)
+{
+    ORE.emit([&]() {
+        OptimizationRemark R(DEBUG_TYPE, "Blocked", BN.topLoop()->getStartLoc(), BN.topLoop()->getHeader());
+        R << "blocked loop nest of depth " << ore::NV("Depth", BN.size()) << " with factors";
+        // One factor per loop of the band (0 if not blocked) for each cache level that was blocked, outermost loop first
+        for (unsigned Level = 0; Level < NumLevels; Level++) {
+            R << (Level ? "; L" : " L") << ore::NV("CacheLevel", Level + 1) << ":";
+            for (BlockedLoop const& BL : Band)
+                R << " " << ore::NV("Factor", Info.getBlockingFactor(BL.Depth, Level));
+        }
+        // CacheCost does not model the blocks: it only tells how much the order of the loops inside them gains
+        if (Info.getOriginalCost() != CacheCost::InvalidCost) {
+            R << ", cache cost " << ore::NV("OriginalCost", Info.getOriginalCost());
+            if (Info.getBlockedCost() != CacheCost::InvalidCost && Info.getBlockedCost() != Info.getOriginalCost())
+                R << " -> " << ore::NV("BlockedCost", Info.getBlockedCost()) << " with the loops reordered";
+        }
+        if (Skewed)
+            R << ", skewed";
+        if (Versioned)
+            R << ", under run-time checks";
+        if (NumPacked)
+            R << ", packing " << ore::NV("Packed", NumPacked) << " arrays";
+        if (NumPrefetches)
+            R << ", prefetching the next block in " << ore::NV("Prefetches", NumPrefetches) << " accesses";
+        return R;
+    });
+}
+
+void LoopBlocking::annotateBlockedLoops(ArrayRef<BlockedLoop> Band, ArrayRef<unsigned> Order)
+{
+    // After permuteLoops the I-th loop of the band runs the iterations of the Order[I]-th one:
+    // it takes its attributes and its trip count. The blocking loops are not moved.
+    SmallVector<MDNode*, MAX_NEST_SIZE> OrigIDs;
+    for (BlockedLoop const& BL : Band)
+        OrigIDs.push_back(BL.L->getLoopID());
+    for (unsigned I = 0; I < Band.size(); I++) {
+        BlockedLoop const& BL = Band[I];
+        MDNode *OrigID = OrigIDs[I];
+        // A blocking loop runs over the blocks of the level above it, the outermost one over the whole loop
+        for (unsigned Level = 0; Level < BL.Levels.size(); Level++) {
+            BlockingLevel const& BLevel = BL.Levels[Level];
+            setTiledLoopID(BLevel.BlockingLoop, OrigID, TileFollowupFloor, false);
+            Optional<unsigned> Extent = Level + 1 < BL.Levels.size() ? Optional<unsigned>(BL.Levels[Level + 1].Factor) : BL.EstimatedTripCount;
+            if (Extent)
+                setLoopEstimatedTripCount(BLevel.BlockingLoop, divideCeil(*Extent, BLevel.Factor), 1);
+        }
+        BlockedLoop const& Iterated = Band[Order[I]];
+        setTiledLoopID(BL.L, OrigIDs[Order[I]], TileFollowupTile, true);
+        // The loop inside the blocks runs at most a block of iterations: e.g. the vectorizer and the unroller
+        // weigh the trip count of the loops they transform
+        if (!Iterated.Levels.empty()) {
+            unsigned Factor = Iterated.Levels.front().Factor;
+            setLoopEstimatedTripCount(BL.L, Iterated.EstimatedTripCount ? std::min(*Iterated.EstimatedTripCount, Factor) : Factor, 1);
+        }
+    }
+}
+
+Optional<CmpInst::Predicate> LoopBlocking::getBlockingPredicate(Loop::LoopBounds const& Bounds, Loop *Top)
+{
+    // Blocking loops jump over the final value by a whole block: they need an ordered comparison.
+    CmpInst::Predicate Pred = Bounds.getCanonicalPredicate();
+    switch (Pred) {
+        case CmpInst::ICMP_SLT:
+        case CmpInst::ICMP_SLE:
+        case CmpInst::ICMP_ULT:
+        case CmpInst::ICMP_ULE:
+            return Pred;
+        case CmpInst::ICMP_NE: {
+            // An increasing IV that stops when it reaches the final value never goes past it:
+            // the test is equivalent to a strict comparison, as long as the initial value is not after the final one
+            const SCEV *Init = SE.getSCEV(&Bounds.getInitialIVValue());
+            const SCEV *Final = SE.getSCEV(&Bounds.getFinalIVValue());
+            if (SE.isLoopEntryGuardedByCond(Top, CmpInst::ICMP_SLE, Init, Final))
+                return CmpInst::ICMP_SLT;
+            if (SE.isLoopEntryGuardedByCond(Top, CmpInst::ICMP_ULE, Init, Final))
+                return CmpInst::ICMP_ULT;
+            return None;
+        }
+        default:
+            return None;
+    }
+}
+
+void LoopBlocking::insertBlockingLoop(Loop *BlockingLoop, Loop *Inner, unsigned Slot)
+{
+    // The blocking loop takes the place of Inner in the loop tree and becomes its parent.
+    // Inner is found at its position among its siblings, instead of looking it up among the top-level loops,
+    // which are as many as the nests of the function
+    SmallVector<BasicBlock*, 4> NewBlocks(BlockingLoop->blocks());
+    Loop *Parent = Inner->getParentLoop();
+    std::vector<Loop*> &Siblings = Parent ? Parent->getSubLoopsVector() : LI.getTopLevelLoopsVector();
+    assert(Slot < Siblings.size() && Siblings[Slot] == Inner && "Nest moved in the loop tree!");
+    Siblings[Slot] = BlockingLoop;
+    BlockingLoop->setParentLoop(Parent);
+    Inner->setParentLoop(nullptr);
+    BlockingLoop->addChildLoop(Inner);
+    for (BasicBlock *BB : Inner->blocks())
+        BlockingLoop->addBlockEntry(BB);
+    for (BasicBlock *BB : NewBlocks) {
+        LI.changeLoopFor(BB, BlockingLoop);
+        for (Loop *Parent = BlockingLoop->getParentLoop(); Parent; Parent = Parent->getParentLoop())
+            Parent->addBlockEntry(BB);
+    }
+}
+
+void LoopBlocking::updateDominatorTree(Loop *Blocking, Loop *Nest)
+{
+    // The blocking loops wrap the nest in a chain: preheader -> header -> preheader of the loop inside -> ... -> nest header,
+    // and each latch is only reached from the exiting block of the loop inside. The dominators are set directly,
+    // once for all the blocking loops: incremental updates, one at a time or batched, rebuild the subtree of the
+    // nearest common dominator of the ends of a deleted edge, which is linear in the size of the function for each
+    // blocking loop. The exit of the nest is moved by setExitDominator, for the same reason.
+    BasicBlock *Exit = Blocking->getExitBlock();
+    BasicBlock *IDom = Blocking->getLoopPreheader();
+    SmallVector<Loop*, MAX_NEST_SIZE * MAX_CACHE_LEVELS> Chain;
+    for (Loop *L = Blocking; L != Nest; L = L->getSubLoops().front()) {
+        assert(L->getSubLoops().size() == 1 && "Blocking loop with more than one subloop!");
+        DT.addNewBlock(L->getHeader(), IDom);
+        IDom = DT.addNewBlock(L->getSubLoops().front()->getLoopPreheader(), L->getHeader())->getBlock();
+        Chain.push_back(L);
+    }
+    // The exit is moved first, so that it is not in the subtree of the nest header when this one is moved
+    setExitDominator(Exit, Blocking->getHeader());
+    DT.changeImmediateDominator(Nest->getHeader(), IDom);
+    for (Loop *L : reverse(Chain))
+        DT.addNewBlock(L->getLoopLatch(), L->getSubLoops().front()->getExitingBlock());
+}
+
+void LoopBlocking::setExitDominator(BasicBlock *Exit, BasicBlock *IDom)
+{
+    // The rest of the function is in the dominator subtree of the exit of a nest, and changing the dominator of a node
+    // walks its whole subtree to update the depths: done for every nest, the pass is quadratic in the number of nests
+    // of a function. When all the nests of the function are transformed, the exit is left at its depth instead:
+    // its predecessors branch to a chain of empty blocks below IDom, just long enough. The chains are removed after
+    // the last nest, and the dominator tree is computed again once.
+    DomTreeNode *ExitNode = DT.getNode(Exit);
+    unsigned Level = DT.getNode(IDom)->getLevel();
+    if (!PadExits || isa<PHINode>(Exit->front()) || ExitNode->getLevel() <= Level + 1) {
+        DT.changeImmediateDominator(Exit, IDom);
+        return;
+    }
+    LLVM_DEBUG(dbgs() << "Padding the exit " << Exit->getName() << " with " << ExitNode->getLevel() - Level - 1 << " blocks.\n");
+    LLVMContext &Ctx = ParentFunc.getContext();
+    Loop *Outer = LI.getLoopFor(Exit);
+    // The first block takes the name of the exit, for the dedicated exits split from it
+    BasicBlock *First = BasicBlock::Create(Ctx, "", &ParentFunc, Exit);
+    First->takeName(Exit);
+    SmallVector<BasicBlock*, 4> Preds(predecessors(Exit));
+    for (BasicBlock *Pred : Preds)
+        Pred->getTerminator()->replaceSuccessorWith(Exit, First);
+    DT.addNewBlock(First, IDom);
+    BasicBlock *Last = First;
+    for (unsigned Depth = Level + 2; Depth < ExitNode->getLevel(); Depth++) {
+        BasicBlock *Pad = BasicBlock::Create(Ctx, "", &ParentFunc, Exit);
+        BranchInst::Create(Pad, Last);
+        DT.addNewBlock(Pad, Last);
+        PadBlocks.push_back(Last);
+        Last = Pad;
+    }
+    BranchInst::Create(Exit, Last);
+    PadBlocks.push_back(Last);
+    if (Outer)
+        for (BasicBlock *BB = First; BB != Exit; BB = BB->getSingleSuccessor())
+            Outer->addBasicBlockToLoop(BB, LI);
+    // Same depth: nothing below the exit is visited
+    DT.changeImmediateDominator(Exit, Last);
+    ExitPads.emplace_back(First, Exit);
+}
+
+void LoopBlocking::formDedicatedExit(Loop *L)
+{
+    // A copy of a loop leaves to the same exit: each one gets a block of its own on the edge from its exiting block,
+    // named as by formDedicatedExitBlocks. The dominator tree is updated directly: the dominance queries made by
+    // SplitBlockPredecessors on the modified tree renumber all of it, for every nest of the function.
+    BasicBlock *Exiting = L->getExitingBlock();
+    BasicBlock *Exit = L->getExitBlock();
+    if (!Exiting || isa<PHINode>(Exit->front())) {
+        formDedicatedExitBlocks(L, &DT, &LI, nullptr, true);
+        return;
+    }
+    BasicBlock *DedicatedExit = BasicBlock::Create(ParentFunc.getContext(), Exit->getName() + ".loopexit", &ParentFunc, Exit);
+    BranchInst::Create(Exit, DedicatedExit);
+    Exiting->getTerminator()->replaceSuccessorWith(Exit, DedicatedExit);
+    if (Loop *ExitLoop = LI.getLoopFor(Exit))
+        ExitLoop->addBasicBlockToLoop(DedicatedExit, LI);
+    DT.addNewBlock(DedicatedExit, Exiting);
+}
+
+void LoopBlocking::removeExitPads()
+{
+    for (auto [First, Exit] : ExitPads)
+        Exit->takeName(First);
+    // Code may have been put in the first block of a chain, e.g. copying a packed array back: such blocks are kept
+    for (BasicBlock *BB : PadBlocks) {
+        if (&BB->front() != BB->getTerminator())
+            continue;
+        BasicBlock *Succ = BB->getSingleSuccessor();
+        SmallVector<BasicBlock*, 4> Preds(predecessors(BB));
+        for (BasicBlock *Pred : Preds)
+            Pred->getTerminator()->replaceSuccessorWith(BB, Succ);
+        LI.removeBlock(BB);
+        BB->eraseFromParent();
+    }
+    ExitPads.clear();
+    PadBlocks.clear();
+    DT.recalculate(ParentFunc);
+}
+
+bool LoopBlocking::permuteLoops(ArrayRef<BlockedLoop> Band, ArrayRef<unsigned> Order)
+{
+    // Loops of a perfect nest in canonical form differ only in their control: initial value, step and exit test.
+    // Instead of moving blocks around, the I-th loop takes the control of the Order[I]-th one
+    // and the body uses its IV in place of the one of Order[I].
+    if (is_sorted(Order))
+        return false;
+
+    Loop *Innermost = Band.back().L;
+    struct LoopControl
+    {
+        PHINode *IV;
+        Instruction *StepInst;
+        Value *Start;
+        Value *Step;
+        unsigned StepIdx;
+        ICmpInst *Cmp;
+        CmpInst::Predicate Pred;
+        Value *End;
+        SmallVector<Use*, 8> IVUses;
+        SmallVector<Use*, 8> StepUses;
+    };
+    SmallVector<LoopControl, MAX_NEST_SIZE> Controls;
+    for (const BlockedLoop &BL : Band) {
+        LoopControl C;
+        C.IV = BL.L->getInductionVariable(SE);
+        C.StepInst = &BL.Bounds->getStepInst();
+        if (!C.IV || C.IV->getType() != Band.front().Bounds->getStepInst().getType())
+            return false;
+        C.Start = C.IV->getIncomingValueForBlock(BL.L->getLoopPreheader());
+        C.StepIdx = C.StepInst->getOperand(0) == C.IV ? 1 : 0;
+        C.Step = C.StepInst->getOperand(C.StepIdx);
+        C.Cmp = BL.L->getLatchCmpInst();
+        if (!C.Cmp || C.Cmp->getOperand(0) != C.StepInst)
+            return false;
+        C.Pred = C.Cmp->getPredicate();
+        C.End = C.Cmp->getOperand(1);
+        // Other uses of the IV must be in the innermost loop, the only place where all the IVs are available
+        for (Use &U : C.IV->uses()) {
+            Instruction *User = cast<Instruction>(U.getUser());
+            if (User == C.StepInst || (User == C.Cmp))
+                continue;
+            if (!Innermost->contains(User))
+                return false;
+            C.IVUses.push_back(&U);
+        }
+        for (Use &U : C.StepInst->uses()) {
+            Instruction *User = cast<Instruction>(U.getUser());
+            if (User == C.IV || User == C.Cmp)
+                continue;
+            if (!Innermost->contains(User))
+                return false;
+            C.StepUses.push_back(&U);
+        }
+        Controls.push_back(std::move(C));
+    }
+
+    LLVM_DEBUG(dbgs() << "Permuting loops inside the block:"; for (unsigned I : Order) dbgs() << ' ' << I; dbgs() << '\n');
+    SmallVector<Instruction*, MAX_NEST_SIZE> OrigStepInsts;
+    for (LoopControl &C : Controls)
+        OrigStepInsts.push_back(C.StepInst->clone());
+    for (unsigned I = 0; I < Controls.size(); I++) {
+        LoopControl &Dst = Controls[I];
+        LoopControl &Src = Controls[Order[I]];
+        Dst.IV->setIncomingValueForBlock(Band[I].L->getLoopPreheader(), Src.Start);
+        Dst.StepInst->setOperand(Dst.StepIdx, Src.Step);
+        Dst.StepInst->copyIRFlags(OrigStepInsts[Order[I]]);
+        Dst.Cmp->setPredicate(Src.Pred);
+        Dst.Cmp->setOperand(1, Src.End);
+        for (Use *U : Src.IVUses)
+            U->set(Dst.IV);
+        for (Use *U : Src.StepUses)
+            U->set(Dst.StepInst);
+    }
+    for (Instruction *I : OrigStepInsts)
+        I->deleteValue();
+    return true;
+}
+
+Optional<std::pair<const SCEV*, const SCEV*>> LoopBlocking::getAccessRange(Instruction *I, Loop *Top)
+{
+    // Lowest and highest (exclusive) address accessed by I in the whole nest: the address must be affine in the nest loops,
+    // with trip counts invariant in the nest. A step whose sign is unknown extends the range both ways, as in LoopAccessAnalysis.
+    const DataLayout &DL = ParentFunc.getParent()->getDataLayout();
+    SmallVector<const SCEV*, MAX_NEST_SIZE> Extents;
+    const SCEV *Cur = SE.getSCEV(getLoadStorePointerOperand(I));
+    while (auto *AR = dyn_cast<SCEVAddRecExpr>(Cur)) {
+        if (!Top->contains(AR->getLoop()))
+            break;
+        const SCEV *BTC = SE.getBackedgeTakenCount(AR->getLoop());
+        const SCEV *Step = AR->getStepRecurrence(SE);
+        if (!AR->isAffine() || isa<SCEVCouldNotCompute>(BTC) || !SE.isLoopInvariant(BTC, Top) || !SE.isLoopInvariant(Step, Top))
+            return None;
+        Extents.push_back(SE.getMulExpr(Step, SE.getTruncateOrZeroExtend(BTC, Step->getType())));
+        Cur = AR->getStart();
+    }
+    if (!SE.isLoopInvariant(Cur, Top))
+        return None;
+    const SCEV *Low = Cur;
+    const SCEV *High = Cur;
+    for (const SCEV *Extent : Extents) {
+        if (SE.isKnownNonNegative(Extent)) {
+            High = SE.getAddExpr(High, Extent);
+        } else if (SE.isKnownNegative(Extent)) {
+            Low = SE.getAddExpr(Low, Extent);
+        } else {
+            Low = SE.getUMinExpr(Low, SE.getAddExpr(Low, Extent));
+            High = SE.getUMaxExpr(High, SE.getAddExpr(High, Extent));
+        }
+    }
+    Type *IndexType = DL.getIndexType(getLoadStorePointerOperand(I)->getType());
+    High = SE.getAddExpr(High, SE.getConstant(IndexType, DL.getTypeStoreSize(getLoadStoreType(I))));
+    return std::make_pair(Low, High);
+}
+
+bool LoopBlocking::versionNest(BlockingNest &BN, BlockingInfo const& Info, ArrayRef<AccessPair> AliasChecks)
+{
+    // The nest is blocked only if some loop whose trip count is unknown at compile time runs at least
+    // Info.getMinBlockedTripCount() iterations, and the accesses in AliasChecks do not overlap.
+    // Otherwise a copy of the original nest runs instead.
+    Loop *Top = BN.topLoop();
+    BasicBlock *CheckBB = Top->getLoopPreheader();
+    BasicBlock *ExitBB = Top->getExitBlock();
+    if (!CheckBB || !ExitBB)
+        return false;
+    Instruction *CheckInsert = CheckBB->getTerminator();
+
+    SmallVector<const SCEV*, MAX_NEST_SIZE> TripCounts;
+    if (Info.getMinBlockedTripCount()) {
+        for (Loop *L : BN) {
+            if (SE.getSmallConstantTripCount(L))
+                continue;
+            const SCEV *BTC = SE.getBackedgeTakenCount(L);
+            if (isa<SCEVCouldNotCompute>(BTC) || !SE.isLoopInvariant(BTC, Top) || !isSafeToExpandAt(BTC, CheckInsert, SE))
+                continue;
+            const SCEV *TripC = SE.getAddExpr(BTC, SE.getOne(BTC->getType()));
+            if (!is_contained(TripCounts, TripC))
+                TripCounts.push_back(TripC);
+        }
+    }
+    DenseMap<Instruction*, std::pair<const SCEV*, const SCEV*>> Ranges;
+    for (AccessPair const& Pair : AliasChecks) {
+        for (Instruction *I : {Pair.first, Pair.second}) {
+            if (Ranges.count(I))
+                continue;
+            Optional<std::pair<const SCEV*, const SCEV*>> Range = getAccessRange(I, Top);
+            if (!Range || !isSafeToExpandAt(Range->first, CheckInsert, SE) || !isSafeToExpandAt(Range->second, CheckInsert, SE))
+                return false;
+            Ranges[I] = *Range;
+        }
+    }
+    if (TripCounts.empty() && AliasChecks.empty())
+        return false;
+    LLVM_DEBUG(dbgs() << "Creating a copy of the original nest for run time checks.\n");
+
+    // Both copies leave to the same block, which is dominated by the checks. It is moved first, so that it is not
+    // in the subtree of the nest header when this one is moved below the new preheader.
+    setExitDominator(ExitBB, CheckBB);
+    // The checks are left alone in the old preheader, the nest gets a new one. SplitBlock would move all the children
+    // of the old preheader, the exit too: only the nest header goes below the new one.
+    BasicBlock *BlockedPH = SplitBlock(CheckBB, CheckInsert, static_cast<DominatorTree*>(nullptr), &LI, nullptr, "blocked.nest.ph");
+    DT.addNewBlock(BlockedPH, CheckBB);
+    DT.changeImmediateDominator(Top->getHeader(), BlockedPH);
+    CheckInsert = CheckBB->getTerminator();
+    SCEVExpander Expander(SE, ParentFunc.getParent()->getDataLayout(), "blocking.check");
+    Value *Blocked = nullptr;
+    auto And = [&](Value *Cond) { Blocked = Blocked ? BinaryOperator::CreateAnd(Blocked, Cond, "blocking.check", CheckInsert) : Cond; };
+    Value *Large = nullptr;
+    for (const SCEV *TripC : TripCounts) {
+        Value *Count = Expander.expandCodeFor(TripC, TripC->getType(), CheckInsert);
+        Constant *Min = ConstantInt::get(TripC->getType(), Info.getMinBlockedTripCount());
+        Value *IsLarge = CmpInst::Create(Instruction::OtherOps::ICmp, CmpInst::ICMP_UGE, Count, Min, "blocking.check.trip", CheckInsert);
+        Large = Large ? BinaryOperator::CreateOr(Large, IsLarge, "blocking.check.trip", CheckInsert) : IsLarge;
+    }
+    if (Large)
+        And(Large);
+    // Addresses are compared as byte pointers
+    auto Expand = [&](const SCEV *Address) {
+        return Expander.expandCodeFor(Address, Type::getInt8PtrTy(ParentFunc.getContext(), Address->getType()->getPointerAddressSpace()),
+                                      CheckInsert);
+    };
+    for (AccessPair const& Pair : AliasChecks) {
+        auto RangeA = Ranges[Pair.first], RangeB = Ranges[Pair.second];
+        Value *ABeforeB = CmpInst::Create(Instruction::OtherOps::ICmp, CmpInst::ICMP_ULE, Expand(RangeA.second), Expand(RangeB.first),
+                                          "blocking.check.before", CheckInsert);
+        Value *BBeforeA = CmpInst::Create(Instruction::OtherOps::ICmp, CmpInst::ICMP_ULE, Expand(RangeB.second), Expand(RangeA.first),
+                                          "blocking.check.after", CheckInsert);
+        And(BinaryOperator::CreateOr(ABeforeB, BBeforeA, "blocking.check.noalias", CheckInsert));
+    }
+
+    SmallVector<BasicBlock*, 16> Blocks;
+    ValueToValueMapTy VMap;
+    Loop *Original = cloneLoopWithPreheader(BlockedPH, CheckBB, Top, VMap, ".orig", &LI, &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+    BasicBlock *OriginalPH = cast<BasicBlock>(VMap[BlockedPH]);
+    OriginalPH->setName("original.nest.ph");
+    // The original nest is never blocked
+    for (Loop *L : Original->getLoopsInPreorder())
+        setTiledLoopID(L, L->getLoopID(), nullptr, true);
+    ReplaceInstWithInst(CheckBB->getTerminator(), BranchInst::Create(BlockedPH, OriginalPH, Blocked));
+
+    formDedicatedExit(Top);
+    formDedicatedExit(Original);
+    SE.forgetLoop(Top);
+    return true;
+}
+
+SmallVector<PackedArray, 4> LoopBlocking::selectPackedArrays(BlockingNest &BN, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info,
+                                                             ArrayRef<AccessPair> AliasChecks, bool Versioned)
+{
+    // An array is packed if all the accesses of the nest to it have the same address, affine in the loops of the band,
+    // and are executed at every iteration: the block of the array is then exactly the set of elements the block of
+    // iterations touches, and copying it neither reads nor writes anything the nest would not.
+    SmallVector<PackedArray, 4> Packed;
+    SmallVector<Instruction*, 16> MemInsts;
+    if (!collectMemoryInstructions(BN, MemInsts))
+        return Packed;
+    const DataLayout &DL = ParentFunc.getParent()->getDataLayout();
+    BasicBlock *InnermostLatch = Band.back().L->getLoopLatch();
+    Instruction *ExpandPt = Band.front().L->getLoopPreheader()->getTerminator();
+
+    SmallVector<PackedArray, 4> Arrays;
+    DenseMap<const SCEV*, unsigned> ArrayIdx;
+    SmallVector<bool, 4> Rejected;
+    for (Instruction *I : MemInsts) {
+        const SCEV *Ptr = SE.getSCEV(getLoadStorePointerOperand(I));
+        auto Ins = ArrayIdx.insert({SE.getPointerBase(Ptr), Arrays.size()});
+        if (Ins.second) {
+            Arrays.emplace_back();
+            Arrays.back().Ptr = Ptr;
+            Arrays.back().ElementType = getLoadStoreType(I);
+            Arrays.back().Alignment = getLoadStoreAlignment(I);
+            Rejected.push_back(false);
+        }
+        PackedArray &PA = Arrays[Ins.first->second];
+        PA.Accesses.push_back(I);
+        PA.Alignment = std::min(PA.Alignment, getLoadStoreAlignment(I));
+        PA.CopyIn |= isa<LoadInst>(I);
+        PA.CopyOut |= isa<StoreInst>(I);
+        // e.g. the neighbours of a stencil, or an access under a condition
+        if (PA.Ptr != Ptr || PA.ElementType != getLoadStoreType(I) || !DT.dominates(I->getParent(), InnermostLatch))
+            Rejected[Ins.first->second] = true;
+    }
+
+    uint64_t BufferBytes = 0;
+    for (unsigned A = 0; A < Arrays.size(); A++) {
+        PackedArray &PA = Arrays[A];
+        if (Rejected[A] || PA.Ptr->getType()->getPointerAddressSpace() != DL.getAllocaAddrSpace())
+            continue;
+
+        // The address is peeled from the innermost loop: what is left is invariant in the band
+        SmallVector<std::pair<unsigned, const SCEV*>, MAX_NEST_SIZE> Found;
+        const SCEV *Cur = PA.Ptr;
+        bool Affine = true;
+        while (auto *AR = dyn_cast<SCEVAddRecExpr>(Cur)) {
+            auto It = find_if(Band, [&](BlockedLoop const& BL) { return BL.L == AR->getLoop(); });
+            if (It == Band.end())
+                break;
+            const SCEV *Step = AR->getStepRecurrence(SE);
+            if (!AR->isAffine() || !SE.isLoopInvariant(Step, BN.topLoop()) || !isSafeToExpandAt(Step, ExpandPt, SE) ||
+                !Info.getBlockingFactor(It->Depth)) {
+                Affine = false;
+                break;
+            }
+            Found.push_back({unsigned(It - Band.begin()), Step});
+            Cur = AR->getStart();
+        }
+        if (!Affine || Found.empty() || !SE.isLoopInvariant(Cur, Band.front().L) || !isSafeToExpandAt(Cur, ExpandPt, SE))
+            continue;
+        PA.Start = Cur;
+
+        // The loop with the smallest constant step is the fastest in the buffer, then the deeper ones
+        auto Slower = [&](std::pair<unsigned, const SCEV*> const& X, std::pair<unsigned, const SCEV*> const& Y) {
+            auto *CX = dyn_cast<SCEVConstant>(X.second);
+            auto *CY = dyn_cast<SCEVConstant>(Y.second);
+            if (CX && CY && CX->getAPInt().abs() != CY->getAPInt().abs())
+                return CX->getAPInt().abs().ugt(CY->getAPInt().abs());
+            if (!CX != !CY)
+                return !CX;
+            return X.first < Y.first;
+        };
+        llvm::sort(Found, Slower);
+        for (auto const& D : Found) {
+            PA.Dims.push_back(D.first);
+            PA.Steps.push_back(D.second);
+        }
+        if (!hasCacheConflicts(PA, Band, Info))
+            continue;
+
+        // The buffer is read and written in place of the array: no other access of the nest may reach the array
+        bool Disjoint = all_of(MemInsts, [&](Instruction *Q) {
+            if (is_contained(PA.Accesses, Q) || (!PA.CopyOut && !isa<StoreInst>(Q)))
+                return true;
+            MemoryLocation ArrayLoc = MemoryLocation::getBeforeOrAfter(getUnderlyingObject(getLoadStorePointerOperand(PA.Accesses.front())));
+            MemoryLocation OtherLoc = MemoryLocation::getBeforeOrAfter(getUnderlyingObject(getLoadStorePointerOperand(Q)));
+            if (AA.isNoAlias(ArrayLoc, OtherLoc))
+                return true;
+            // Overlapping arrays run the original nest
+            return Versioned && any_of(AliasChecks, [&](AccessPair const& P) {
+                return (is_contained(PA.Accesses, P.first) && P.second == Q) || (is_contained(PA.Accesses, P.second) && P.first == Q);
+            });
+        });
+        if (!Disjoint) {
+            LLVM_DEBUG(dbgs() << "Array " << *PA.Ptr << " may be accessed through other pointers: not packed\n");
+            continue;
+        }
+
+        uint64_t Bytes = DL.getTypeAllocSize(PA.ElementType);
+        for (unsigned Pos : PA.Dims)
+            Bytes *= Info.getBlockingFactor(Band[Pos].Depth);
+        if (BufferBytes + Bytes > MAX_PACK_SIZE)
+            continue;
+        BufferBytes += Bytes;
+        LLVM_DEBUG(dbgs() << "Packing the blocks of " << *PA.Ptr << " in " << Bytes << " bytes\n");
+        Packed.push_back(std::move(PA));
+    }
+    return Packed;
+}
+
+bool LoopBlocking::hasCacheConflicts(PackedArray const& PA, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info)
+{
+    // The rows of a block along a loop start Step bytes apart: they fall in min(Sets, Way / gcd(Step mod Way, Way)) different
+    // sets of the L1 cache, where Way is the size of a way, e.g. a single one for power-of-two leading dimensions. The block conflicts with itself
+    // if some set gets as many rows as the cache has ways. Steps unknown at compile time are assumed to conflict.
+    CacheInfo Cache = getCacheInfo(0);
+    uint64_t Way = Cache.Size / std::max(Cache.Associativity, 1u);
+    if (Way < Cache.LineSize)
+        return false;
+    for (unsigned K = 0; K < PA.Dims.size(); K++) {
+        auto *Step = dyn_cast<SCEVConstant>(PA.Steps[K]);
+        if (!Step)
+            return true;
+        uint64_t Bytes = Step->getAPInt().abs().getLimitedValue();
+        if (Bytes < Cache.LineSize)
+            continue;
+        uint64_t Rows = Info.getBlockingFactor(Band[PA.Dims[K]].Depth);
+        uint64_t Positions = std::min(Way / Cache.LineSize, Way / greatestCommonDivisor(Bytes % Way, Way));
+        if (divideCeil(Rows, Positions) >= Cache.Associativity)
+            return true;
+    }
+    return false;
+}
+
+void LoopBlocking::packArray(PackedArray const& PA, ArrayRef<BlockedLoop> Band, Loop *Nest)
+{
+    // The block is copied in right before the outermost loop that runs inside it: the blocking loops of the loops
+    // the address does not depend on, if they are inside the ones of the loops it depends on, reuse the same block.
+    //     buffer = block of the array at (BlockIV_0, BlockIV_1)
+    //     for (i0 = BlockIV_0; i0 < BlockEnd_0; i0++)
+    //         for (i1 = BlockIV_1; i1 < BlockEnd_1; i1++)
+    //             ... buffer[(i0 - BlockIV_0) * Factor_1 + (i1 - BlockIV_1)] ...
+    //     block of the array at (BlockIV_0, BlockIV_1) = buffer
+    LLVMContext &Ctx = ParentFunc.getContext();
+    const DataLayout &DL = ParentFunc.getParent()->getDataLayout();
+    Loop *Place = Nest;
+    while (Loop *Parent = Place->getParentLoop()) {
+        auto IsBlockOf = [&](BlockedLoop const& BL) { return !BL.Levels.empty() && BL.Levels.front().BlockingLoop == Parent; };
+        auto It = find_if(Band, IsBlockOf);
+        if (It == Band.end() || is_contained(PA.Dims, unsigned(It - Band.begin())))
+            break;
+        Place = Parent;
+    }
+    Instruction *InsertPt = Place->getLoopPreheader()->getTerminator();
+    BasicBlock *Exit = Place->getExitBlock();
+    assert(Exit && "Loop inside the block with more than one exit!");
+
+    // One buffer for each array, allocated once in the frame of the function
+    SmallVector<unsigned, MAX_NEST_SIZE> Factors;
+    SmallVector<uint64_t, MAX_NEST_SIZE> BufferStrides(PA.Dims.size());
+    for (unsigned Pos : PA.Dims)
+        Factors.push_back(Band[Pos].Levels.front().Factor);
+    uint64_t Bytes = DL.getTypeAllocSize(PA.ElementType);
+    for (unsigned K = PA.Dims.size(); K-- > 0;) {
+        BufferStrides[K] = Bytes;
+        Bytes *= Factors[K];
+    }
+    Type *BufferTy = ArrayType::get(Type::getInt8Ty(Ctx), Bytes);
+    AllocaInst *Buffer = new AllocaInst(BufferTy, DL.getAllocaAddrSpace(), nullptr, Align(getCacheInfo(0).LineSize), "pack.buffer",
+                                        &*ParentFunc.getEntryBlock().getFirstInsertionPt());
+    Type *IndexTy = DL.getIndexType(PA.Ptr->getType());
+    Value *Zero = ConstantInt::get(IndexTy, 0);
+
+    // Iterations of each loop from the start of the loop to the start of the block, and inside the block
+    auto Position = [&](BlockedLoop const& BL, Value *IV, Value *Start, Instruction *Before) -> Value* {
+        Value *Pos = BinaryOperator::CreateNUWSub(IV, Start, "pack.pos", Before);
+        uint64_t Step = cast<ConstantInt>(BL.Bounds->getStepValue())->getZExtValue();
+        if (Step > 1)
+            Pos = BinaryOperator::CreateExactUDiv(Pos, ConstantInt::get(Pos->getType(), Step), "pack.pos", Before);
+        return CastInst::CreateZExtOrBitCast(Pos, IndexTy, "pack.pos", Before);
+    };
+
+    // Address of the first element of the block and iterations of the block along each loop: the last block is cut by the bound
+    SCEVExpander Expander(SE, DL, "pack");
+    Value *Array = Expander.expandCodeFor(PA.Start, Type::getInt8PtrTy(Ctx, DL.getAllocaAddrSpace()), InsertPt);
+    SmallVector<Value*, MAX_NEST_SIZE> Steps, Counts;
+    for (unsigned K = 0; K < PA.Dims.size(); K++) {
+        BlockedLoop const& BL = Band[PA.Dims[K]];
+        BlockingLevel const& Block = BL.Levels.front();
+        Steps.push_back(Expander.expandCodeFor(SE.getTruncateOrSignExtend(PA.Steps[K], IndexTy), IndexTy, InsertPt));
+        Value *Offset = BinaryOperator::CreateMul(Position(BL, Block.BlockIV, &BL.Bounds->getInitialIVValue(), InsertPt),
+                                                  Steps.back(), "pack.offset", InsertPt);
+        Array = GetElementPtrInst::CreateInBounds(Type::getInt8Ty(Ctx), Array, Offset, "pack.block", InsertPt);
+        Value *End = Block.BlockEnd;
+        if (CmpInst::isNonStrictPredicate(BL.Predicate))
+            End = BinaryOperator::CreateAdd(End, ConstantInt::get(End->getType(), 1), "pack.end", InsertPt);
+        uint64_t Step = cast<ConstantInt>(BL.Bounds->getStepValue())->getZExtValue();
+        if (Step > 1)
+            End = BinaryOperator::CreateAdd(End, ConstantInt::get(End->getType(), Step - 1), "pack.end", InsertPt);
+        Value *Count = BinaryOperator::CreateNUWSub(End, Block.BlockIV, "pack.count", InsertPt);
+        if (Step > 1)
+            Count = BinaryOperator::CreateUDiv(Count, ConstantInt::get(Count->getType(), Step), "pack.count", InsertPt);
+        Counts.push_back(CastInst::CreateZExtOrBitCast(Count, IndexTy, "pack.count", InsertPt));
+    }
+
+    // The exit is split first: the copy in moves the preheader
+    if (PA.CopyOut)
+        createCopyLoops(PA, &*Exit->getFirstInsertionPt(), Array, Buffer, Steps, BufferStrides, Counts, Factors, false);
+    if (PA.CopyIn)
+        createCopyLoops(PA, InsertPt, Array, Buffer, Steps, BufferStrides, Counts, Factors, true);
+
+    // Each access reads or writes the element of the buffer at its position in the block
+    for (Instruction *I : PA.Accesses) {
+        Value *Offset = nullptr;
+        for (unsigned K = 0; K < PA.Dims.size(); K++) {
+            BlockedLoop const& BL = Band[PA.Dims[K]];
+            Value *Pos = Position(BL, BL.IV, BL.Levels.front().BlockIV, I);
+            Value *Term = BinaryOperator::CreateNUWMul(Pos, ConstantInt::get(IndexTy, BufferStrides[K]), "pack.offset", I);
+            Offset = Offset ? BinaryOperator::CreateNUWAdd(Offset, Term, "pack.offset", I) : Term;
+        }
+        Value *Addr = GetElementPtrInst::CreateInBounds(BufferTy, Buffer, {Zero, Offset}, "pack.addr", I);
+        Value *Ptr = getLoadStorePointerOperand(I);
+        Addr = CastInst::CreatePointerCast(Addr, Ptr->getType(), "pack.addr", I);
+        I->setOperand(isa<LoadInst>(I) ? LoadInst::getPointerOperandIndex() : StoreInst::getPointerOperandIndex(), Addr);
+        RecursivelyDeleteTriviallyDeadInstructions(Ptr);
+    }
+}
+
+void LoopBlocking::createCopyLoops(PackedArray const& PA, Instruction *InsertPt, Value *Array, Value *Buffer, ArrayRef<Value*> Steps,
+                                   ArrayRef<uint64_t> BufferStrides, ArrayRef<Value*> Counts, ArrayRef<unsigned> Factors, bool ToBuffer)
+{
+    // A loop for each loop the address depends on, tested at the bottom since blocks are never empty:
+    //     t0 = 0
+    //     do {
+    //         t1 = 0
+    //         do {
+    //             buffer[t0 * BufferStride_0 + t1 * BufferStride_1] = array[t0 * Step_0 + t1 * Step_1]   (or the other way)
+    //         } while (++t1 < Count_1)
+    //     } while (++t0 < Count_0)
+    LLVMContext &Ctx = ParentFunc.getContext();
+    const DataLayout &DL = ParentFunc.getParent()->getDataLayout();
+    StringRef Name = ToBuffer ? "pack" : "unpack";
+    Type *IndexTy = Steps.front()->getType();
+    unsigned Depth = PA.Dims.size();
+    BasicBlock *Before = InsertPt->getParent();
+    BasicBlock *After = SplitBlock(Before, InsertPt, &DT, &LI, nullptr, Name + ".done");
+    SmallVector<BasicBlock*, MAX_NEST_SIZE> Headers, Latches;
+    for (unsigned K = 0; K < Depth; K++)
+        Headers.push_back(BasicBlock::Create(Ctx, Name + ".loop", &ParentFunc, After));
+    // The innermost loop is a single block
+    for (unsigned K = Depth - 1; K-- > 0;)
+        Latches.insert(Latches.begin(), BasicBlock::Create(Ctx, Name + ".latch", &ParentFunc, After));
+    Latches.push_back(Headers.back());
+    Before->getTerminator()->replaceSuccessorWith(After, Headers.front());
+
+    SmallVector<PHINode*, MAX_NEST_SIZE> IVs;
+    Value *ArrayOffset = nullptr, *BufferOffset = nullptr;
+    for (unsigned K = 0; K < Depth; K++) {
+        BasicBlock *Header = Headers[K];
+        PHINode *IV = PHINode::Create(IndexTy, 2, Name + ".iv", Header);
+        IV->addIncoming(ConstantInt::get(IndexTy, 0), K ? Headers[K - 1] : Before);
+        IVs.push_back(IV);
+        Value *ArrayTerm = BinaryOperator::CreateMul(IV, Steps[K], Name + ".offset", Header);
+        Value *BufferTerm = BinaryOperator::CreateNUWMul(IV, ConstantInt::get(IndexTy, BufferStrides[K]), Name + ".offset", Header);
+        ArrayOffset = ArrayOffset ? BinaryOperator::CreateAdd(ArrayOffset, ArrayTerm, Name + ".offset", Header) : ArrayTerm;
+        BufferOffset = BufferOffset ? BinaryOperator::CreateNUWAdd(BufferOffset, BufferTerm, Name + ".offset", Header) : BufferTerm;
+        if (K + 1 < Depth)
+            BranchInst::Create(Headers[K + 1], Header);
+    }
+
+    BasicBlock *Body = Headers.back();
+    Type *PtrTy = PA.ElementType->getPointerTo(DL.getAllocaAddrSpace());
+    Value *ArrayAddr = GetElementPtrInst::CreateInBounds(Type::getInt8Ty(Ctx), Array, ArrayOffset, Name + ".array", Body);
+    ArrayAddr = CastInst::CreatePointerCast(ArrayAddr, PtrTy, Name + ".array", Body);
+    Value *Zero = ConstantInt::get(IndexTy, 0);
+    Value *BufferAddr = GetElementPtrInst::CreateInBounds(cast<AllocaInst>(Buffer)->getAllocatedType(), Buffer, {Zero, BufferOffset},
+                                                          Name + ".buffer", Body);
+    BufferAddr = CastInst::CreatePointerCast(BufferAddr, PtrTy, Name + ".buffer", Body);
+    Value *Element = new LoadInst(PA.ElementType, ToBuffer ? ArrayAddr : BufferAddr, Name + ".element", false, PA.Alignment, Body);
+    new StoreInst(Element, ToBuffer ? BufferAddr : ArrayAddr, false, PA.Alignment, Body);
+
+    for (unsigned K = Depth; K-- > 0;) {
+        BasicBlock *Latch = Latches[K];
+        Value *Next = BinaryOperator::CreateNUWAdd(IVs[K], ConstantInt::get(IndexTy, 1), Name + ".iv.next", Latch);
+        Value *Cond = new ICmpInst(*Latch, ICmpInst::ICMP_ULT, Next, Counts[K], Name + ".cond");
+        BranchInst::Create(Headers[K], K ? Latches[K - 1] : After, Cond, Latch);
+        IVs[K]->addIncoming(Next, Latch);
+    }
+
+    // The new loops go inside the loop around the insertion point, and are not transformed again
+    Loop *Outer = LI.getLoopFor(Before);
+    SmallVector<Loop*, MAX_NEST_SIZE> Loops;
+    for (unsigned K = 0; K < Depth; K++) {
+        Loop *L = LI.AllocateLoop();
+        if (Outer)
+            Outer->addChildLoop(L);
+        else
+            LI.addTopLevelLoop(L);
+        L->addBasicBlockToLoop(Headers[K], LI);
+        Loops.push_back(L);
+        Outer = L;
+    }
+    for (unsigned K = 0; K + 1 < Depth; K++)
+        Loops[K]->addBasicBlockToLoop(Latches[K], LI);
+
+    DT.addNewBlock(Headers.front(), Before);
+    for (unsigned K = 1; K < Depth; K++)
+        DT.addNewBlock(Headers[K], Headers[K - 1]);
+    for (unsigned K = Depth - 1; K-- > 0;)
+        DT.addNewBlock(Latches[K], Latches[K + 1]);
+    DT.changeImmediateDominator(After, Latches.front());
+
+    for (unsigned K = 0; K < Depth; K++) {
+        setTiledLoopID(Loops[K], nullptr, nullptr, false);
+        setLoopEstimatedTripCount(Loops[K], Factors[K], 1);
+    }
+}
+
+Loop *LoopBlocking::versionFullTiles(ArrayRef<BlockedLoop> Band, Loop *Nest)
+{
+    // Most blocks are not cut by the loop bounds: for them the loops inside the block run exactly
+    // BlockingFactor iterations. A copy of the nest bounded by the unclamped block ends runs these blocks,
+    // so that its trip counts are constant; the original nest, with the min, only runs the blocks at the border.
+    BasicBlock *CheckBB = Nest->getLoopPreheader();
+    BasicBlock *ExitBB = Nest->getExitBlock();
+    if (!CheckBB || !ExitBB)
+        return nullptr;
+    LLVM_DEBUG(dbgs() << "Creating a copy of the nest for full blocks.\n");
+
+    // The check is left alone in the old preheader, the nest gets a new one
+    BasicBlock *PartialPH = SplitBlock(CheckBB, CheckBB->getTerminator(), &DT, &LI, nullptr, "partial.tile.ph");
+    SmallVector<BasicBlock*, 16> Blocks;
+    ValueToValueMapTy VMap;
+    Loop *FullNest = cloneLoopWithPreheader(PartialPH, CheckBB, Nest, VMap, ".full", &LI, &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+    BasicBlock *FullPH = cast<BasicBlock>(VMap[PartialPH]);
+    FullPH->setName("full.tile.ph");
+
+    // A block is full if it ends before the loop bound along every blocked loop.
+    // The end is computed with a wrapping add: it must also come after the start of the block.
+    Instruction *InsertPt = CheckBB->getTerminator();
+    Value *IsFull = nullptr;
+    for (const BlockedLoop &BL : Band) {
+        if (BL.Levels.empty())
+            continue;
+        const BlockingLevel &Inner = BL.Levels.front();
+        bool Signed = CmpInst::isSigned(BL.Predicate);
+        Value *Full = CmpInst::Create(Instruction::OtherOps::ICmp, Signed ? CmpInst::ICMP_SLE : CmpInst::ICMP_ULE,
+                                      Inner.FullBlockEnd, &BL.Bounds->getFinalIVValue(), "full.tile.dim", InsertPt);
+        Value *NoWrap = CmpInst::Create(Instruction::OtherOps::ICmp, Signed ? CmpInst::ICMP_SLT : CmpInst::ICMP_ULT,
+                                        Inner.BlockIV, Inner.FullBlockEnd, "full.tile.nowrap", InsertPt);
+        Full = BinaryOperator::CreateAnd(Full, NoWrap, "full.tile.dim", InsertPt);
+        IsFull = IsFull ? BinaryOperator::CreateAnd(IsFull, Full, "full.tile", InsertPt) : Full;
+
+        // The copy iterates up to the end of the block, which is known not to wrap there:
+        // its loops run exactly BlockingFactor iterations
+        Instruction *FullEnd = cast<Instruction>(Inner.FullBlockEnd)->clone();
+        FullEnd->setName("full.tile.end");
+        FullEnd->insertBefore(FullPH->getTerminator());
+        if (Signed)
+            FullEnd->setHasNoSignedWrap(true);
+        else
+            FullEnd->setHasNoUnsignedWrap(true);
+        for (BasicBlock *BB : Blocks)
+            for (Instruction &I : *BB)
+                if (&I != FullEnd)
+                    I.replaceUsesOfWith(Inner.BlockEnd, FullEnd);
+    }
+    assert(IsFull && "No blocked loop in the band!");
+    ReplaceInstWithInst(CheckBB->getTerminator(), BranchInst::Create(FullPH, PartialPH, IsFull));
+
+    // Both copies leave to the same block, which is now dominated by the check
+    DT.changeImmediateDominator(ExitBB, CheckBB);
+    formDedicatedExit(Nest);
+    formDedicatedExit(FullNest);
+    return FullNest;
+}
+
+unsigned LoopBlocking::insertPrefetches(ArrayRef<BlockedLoop> Band, Loop *Nest)
+{
+    // The innermost blocking loop knows which block comes next: the accesses of the loops inside the block prefetch
+    // the element at the same position in that block, which differs by the step of their address along the blocking loop.
+    // The next block is brought in over the whole current one, instead of stalling on its first accesses; the jumps
+    // between the rows of a block defeat the hardware prefetchers. Distances follow LoopDataPrefetch:
+    // the target prefetch distance in instructions, over the size of the innermost loop, gives the iterations ahead.
+    Loop *Blocking = Nest->getParentLoop();
+    auto It = find_if(Band, [&](BlockedLoop const& BL) { return !BL.Levels.empty() && BL.Levels.front().BlockingLoop == Blocking; });
+    if (!Blocking || It == Band.end())
+        return 0;
+    Loop *Innermost = Nest;
+    while (Innermost->getSubLoops().size() == 1)
+        Innermost = Innermost->getSubLoops().front();
+    if (!Innermost->getSubLoops().empty() || !Innermost->getLoopPreheader())
+        return 0;
+
+    SmallPtrSet<const Value*, 32> EphValues;
+    CodeMetrics::collectEphemeralValues(Innermost, &AC, EphValues);
+    CodeMetrics Metrics;
+    for (BasicBlock *BB : Innermost->blocks())
+        Metrics.analyzeBasicBlock(BB, TTI, EphValues);
+    unsigned LoopSize = std::max(Metrics.NumInsts, 1u);
+
+    // Iterations of the innermost loop in a block, at least: the loops that are not blocked run their whole trip count
+    uint64_t BlockIters = 1;
+    for (BlockedLoop const& BL : Band)
+        if (!BL.Levels.empty())
+            BlockIters = SaturatingMultiply<uint64_t>(BlockIters, BL.Levels.front().Factor);
+    unsigned Distance = PrefetchDistance.getNumOccurrences() ? PrefetchDistance : TTI.getPrefetchDistance();
+    uint64_t BlocksAhead = std::max<uint64_t>(divideCeil(Distance / LoopSize, BlockIters), 1);
+    if (SaturatingMultiply(BlocksAhead, BlockIters) > TTI.getMaxPrefetchIterationsAhead()) {
+        LLVM_DEBUG(dbgs() << "The next block is further ahead than the target prefetches.\n");
+        return 0;
+    }
+
+    // The address is peeled from the loops inside the block: what is left steps along the blocking loop
+    struct PrefetchedAccess
+    {
+        Instruction *I;
+        const SCEV *Ptr;
+        const SCEV *Step;
+        bool Write;
+    };
+    SmallVector<PrefetchedAccess, 8> Accesses;
+    unsigned NumMemAccesses = 0, NumStridedMemAccesses = 0;
+    unsigned LineSize = getCacheInfo(0).LineSize;
+    Instruction *ExpandPt = Nest->getLoopPreheader()->getTerminator();
+    for (BasicBlock *BB : Innermost->blocks()) {
+        for (Instruction &I : *BB) {
+            if (!isa<LoadInst>(I) && !isa<StoreInst>(I))
+                continue;
+            NumMemAccesses++;
+            const SCEV *Ptr = SE.getSCEV(getLoadStorePointerOperand(&I));
+            const SCEV *Cur = Ptr;
+            while (isa<SCEVAddRecExpr>(Cur) && Nest->contains(cast<SCEVAddRecExpr>(Cur)->getLoop()))
+                Cur = cast<SCEVAddRecExpr>(Cur)->getStart();
+            auto *AR = dyn_cast<SCEVAddRecExpr>(Cur);
+            if (!AR || AR->getLoop() != Blocking || !AR->isAffine())
+                continue;
+            const SCEV *Step = AR->getStepRecurrence(SE);
+            if (!SE.isLoopInvariant(Step, Blocking) || !isSafeToExpandAt(Step, ExpandPt, SE))
+                continue;
+            NumStridedMemAccesses++;
+            if (isa<StoreInst>(I) && !TTI.enableWritePrefetching())
+                continue;
+            // Accesses to the same cache line share a prefetch
+            auto SameLine = find_if(Accesses, [&](PrefetchedAccess const& PA) {
+                auto *Diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(Ptr, PA.Ptr));
+                return PA.Step == Step && Diff && Diff->getAPInt().abs().ult(LineSize);
+            });
+            if (SameLine != Accesses.end())
+                SameLine->Write |= isa<StoreInst>(I);
+            else
+                Accesses.push_back({&I, Ptr, Step, isa<StoreInst>(I)});
+        }
+    }
+
+    // Blocks close enough in memory are left to the hardware prefetchers
+    unsigned MinStride = TTI.getMinPrefetchStride(NumMemAccesses, NumStridedMemAccesses, Accesses.size(), Metrics.NumCalls > 0);
+    LLVMContext &Ctx = ParentFunc.getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    SCEVExpander Expander(SE, ParentFunc.getParent()->getDataLayout(), "prefetch");
+    unsigned NumPrefetches = 0;
+    for (PrefetchedAccess const& PA : Accesses) {
+        const SCEV *Offset = SE.getMulExpr(PA.Step, SE.getConstant(PA.Step->getType(), BlocksAhead));
+        auto *ConstOffset = dyn_cast<SCEVConstant>(Offset);
+        if (ConstOffset && ConstOffset->getAPInt().abs().ult(MinStride))
+            continue;
+        // An address that does not change in the innermost loop is prefetched once, before it
+        Value *Ptr = getLoadStorePointerOperand(PA.I);
+        Instruction *InsertPt = PA.I;
+        bool Hoisted = false;
+        if (SE.isLoopInvariant(PA.Ptr, Innermost) && Innermost->makeLoopInvariant(Ptr, Hoisted))
+            InsertPt = Innermost->getLoopPreheader()->getTerminator();
+        // The next block may be past the end of the array: prefetches do not fault, but the address is not inbounds
+        Value *Addr = CastInst::CreatePointerCast(Ptr, Type::getInt8PtrTy(Ctx, Ptr->getType()->getPointerAddressSpace()), "prefetch.ptr",
+                                                  InsertPt);
+        Addr = GetElementPtrInst::Create(Type::getInt8Ty(Ctx), Addr, Expander.expandCodeFor(Offset, Offset->getType(), ExpandPt),
+                                         "prefetch.addr", InsertPt);
+        Function *PrefetchFunc = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::prefetch, {Addr->getType()});
+        // Read or write, high temporal locality, data cache
+        Value *Args[] = {Addr, ConstantInt::get(Int32Ty, PA.Write), ConstantInt::get(Int32Ty, 3), ConstantInt::get(Int32Ty, 1)};
+        CallInst::Create(PrefetchFunc, Args, "", InsertPt);
+        NumPrefetches++;
+    }
+    return NumPrefetches;
+}
+
+unsigned LoopBlocking::getUnrollAndJamFactor(Loop *Outer)
+{
+    if (UnrollAndJamFactor.getNumOccurrences())
+        return UnrollAndJamFactor;
+    // Each copy of the outer loop body needs its own register for every reference that changes with the outer loop:
+    // the other references are shared by all the copies and stay in registers across the inner loop.
+    // References are counted as one vector register each, since the inner loop is the one that gets vectorized.
+    Loop *Inner = Outer->getSubLoops().front();
+    unsigned VaryingRefs = 0;
+    for (BasicBlock *BB : Inner->blocks())
+        for (Instruction &I : *BB) {
+            Value *Ptr = getLoadStorePointerOperand(&I);
+            if (!Ptr || isa<StoreInst>(I))
+                continue;
+            bool Varying = SCEVExprContains(SE.getSCEV(Ptr), [Outer](const SCEV *S) {
+                const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S);
+                return AR && AR->getLoop() == Outer;
+            });
+            VaryingRefs += Varying;
+        }
+    bool Vector = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize() > 0;
+    unsigned Registers = TTI.getNumberOfRegisters(TTI.getRegisterClassForType(Vector));
+    LLVM_DEBUG(dbgs() << "Unroll-and-jam: " << Registers << (Vector ? " vector" : " scalar") << " registers, "
+                      << VaryingRefs << " references varying with the outer loop\n");
+    // Half of the registers are left for the shared references and the address computations
+    unsigned Factor = PowerOf2Floor(Registers / 2 / std::max(VaryingRefs, 1u));
+    return std::min(Factor, MAX_UNROLL_AND_JAM_FACTOR);
+}
+
+bool LoopBlocking::canUnrollAndJam(Loop *Outer)
+{
+    // The shape UnrollAndJamLoop relies on, as checked by isSafeToUnrollAndJam, which asserts (or crashes) on anything else:
+    // the outer loop body is split into the blocks before the inner loop (fore), which must all lead to it,
+    // the inner loop, and a single block after it (aft) ending in the outer latch.
+    Loop *Inner = Outer->getSubLoops().front();
+    if (!Outer->isLoopSimplifyForm() || !Inner->isLoopSimplifyForm())
+        return false;
+    if (Outer->getLoopLatch() != Outer->getExitingBlock() || Inner->getLoopLatch() != Inner->getExitingBlock())
+        return false;
+    if (Outer->getHeader()->hasAddressTaken() || Inner->getHeader()->hasAddressTaken())
+        return false;
+    SmallPtrSet<BasicBlock*, 8> Fore, Aft;
+    for (BasicBlock *BB : Outer->blocks())
+        if (!Inner->contains(BB))
+            (DT.dominates(Inner->getLoopLatch(), BB) ? Aft : Fore).insert(BB);
+    for (BasicBlock *BB : Fore)
+        if (BB != Inner->getLoopPreheader() && any_of(successors(BB), [&](BasicBlock *Succ) { return !Fore.count(Succ); })) {
+            LLVM_DEBUG(dbgs() << "Unroll-and-jam: the code before the inner loop does not always reach it\n");
+            return false;
+        }
+    if (Aft.size() != 1) {
+        LLVM_DEBUG(dbgs() << "Unroll-and-jam: more than one block after the inner loop\n");
+        return false;
+    }
+    // The trip count of the inner loop must be the same at every iteration of the outer loop
+    if (!hasIterationCountInvariantInParent(Inner, SE))
+        return false;
+    SimpleLoopSafetyInfo SafetyInfo;
+    SafetyInfo.computeLoopSafetyInfo(Outer);
+    if (SafetyInfo.anyBlockMayThrow())
+        return false;
+    // The next values of the outer header phis are moved before the inner loop of the jammed copies
+    SmallVector<Instruction*, 8> Worklist;
+    SmallPtrSet<Instruction*, 8> Visited;
+    for (PHINode &Phi : Outer->getHeader()->phis())
+        if (auto *I = dyn_cast<Instruction>(Phi.getIncomingValueForBlock(Outer->getLoopLatch())))
+            Worklist.push_back(I);
+    while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        if (!Visited.insert(I).second || !Aft.count(I->getParent())) {
+            if (Inner->contains(I))
+                return false;
+            continue;
+        }
+        if (isa<PHINode>(I) || I->mayHaveSideEffects() || I->mayReadOrWriteMemory())
+            return false;
+        for (Value *Op : I->operands())
+            if (auto *OpI = dyn_cast<Instruction>(Op))
+                Worklist.push_back(OpI);
+    }
+    return true;
+}
+
+bool LoopBlocking::unrollAndJamBlock(Loop *Nest)
+{
+    // The loop around the innermost one is unrolled and its copies are fused inside the innermost loop:
+    // the result is a micro-kernel keeping several rows of results in registers across the inner loop.
+    Loop *Outer = Nest;
+    while (!Outer->getSubLoops().empty() && !Outer->getSubLoops().front()->isInnermost())
+        Outer = Outer->getSubLoops().front();
+    if (Outer->isInnermost() || Outer->getSubLoops().size() != 1)
+        return false;
+    // Unroll-and-jam moves iterations of the outer loop inside the inner one, like an interchange:
+    // it is legal because both loops belong to the band, which checkDependences found fully permutable.
+    // isSafeToUnrollAndJam is not used since DependenceInfo cannot analyze subscripts starting at the block IV:
+    // only its checks on the shape of the loops are.
+    if (Outer->getLoopDepth() - Nest->getLoopDepth() < FirstLoopDepth) {
+        LLVM_DEBUG(dbgs() << "Unroll-and-jam: loop " << Outer->getName() << " is not blocked\n");
+        return false;
+    }
+    if (!canUnrollAndJam(Outer)) {
+        LLVM_DEBUG(dbgs() << "Unroll-and-jam: loop " << Outer->getName() << " does not have the shape UnrollAndJamLoop needs\n");
+        return false;
+    }
+    // Full blocks have a constant trip count: a factor that divides it leaves no remainder loop
+    unsigned TripCount = SE.getSmallConstantTripCount(Outer);
+    unsigned Factor = getUnrollAndJamFactor(Outer);
+    while (Factor > 1 && TripCount % Factor)
+        Factor /= 2;
+    if (!TripCount || Factor < 2) {
+        LLVM_DEBUG(dbgs() << "Unroll-and-jam: no factor dividing trip count " << TripCount << '\n');
         return false;
     }
+    LLVM_DEBUG(dbgs() << "Unroll-and-jam loop " << Outer->getName() << " by " << Factor << '\n');
+    LoopUnrollResult Result = UnrollAndJamLoop(Outer, Factor, TripCount, SE.getSmallConstantTripMultiple(Outer),
+                                               false, &LI, &SE, &DT, &AC, &TTI, &ORE);
+    return Result != LoopUnrollResult::Unmodified;
+}
 
-    if (!BN.areAllLoopsSimplified()) {
-        LLVM_DEBUG(dbgs() << "Not all loops are in simplified form!\n");
+bool LoopBlocking::outlineParallelLoop(BlockingLevel const& Parallel)
+{
+    // The body of the blocking loop (everything but its header and latch) becomes a function of the block IV.
+    // The loop is then replaced by a call to the runtime, which runs the iterations on a thread pool:
+    //   lb_parallel_for(Start, End, Step, Body, Ctx)
+    // where Body is a trampoline unpacking the other inputs of the outlined function from the Ctx struct.
+    Loop *L = Parallel.BlockingLoop;
+    PHINode *IV = Parallel.BlockIV;
+    CmpInst *ExitCond = Parallel.ExitCond;
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Preheader = L->getLoopPreheader();
+    BasicBlock *Exit = L->getExitBlock();
+    Type *Int64Ty = Type::getInt64Ty(ParentFunc.getContext());
+    CmpInst::Predicate Pred = ExitCond->getPredicate();
+    Value *Start = IV->getIncomingValueForBlock(Preheader);
+    Value *End = ExitCond->getOperand(1);
+    auto *Update = dyn_cast<BinaryOperator>(IV->getIncomingValueForBlock(Latch));
+    // The runtime iterates on signed 64 bits integers, with an exclusive end
+    if (!Preheader || !Exit || !Update || !isa<ConstantInt>(Update->getOperand(1)) || !CmpInst::isSigned(Pred) ||
+        IV->getType()->getIntegerBitWidth() > 64 ||
+        (Pred == CmpInst::ICMP_SLE && IV->getType()->getIntegerBitWidth() == 64)) {
+        LLVM_DEBUG(dbgs() << "Blocking loop " << L->getName() << " cannot be run by the runtime.\n");
         return false;
     }
+    if (auto *EndInst = dyn_cast<Instruction>(End))
+        if (L->contains(EndInst))
+            return false;
 
-    if (!BN.areAllLoopsRotated()) {
-        LLVM_DEBUG(dbgs() << "Not all loops are in rotated form!\n");
+    SmallVector<BasicBlock*, 16> Body;
+    for (BasicBlock *BB : L->blocks())
+        if (BB != Header && BB != Latch)
+            Body.push_back(BB);
+    CodeExtractor CE(Body, &DT, false, nullptr, nullptr, &AC, false, false, "block");
+    if (!CE.isEligible()) {
+        LLVM_DEBUG(dbgs() << "Body of blocking loop " << L->getName() << " cannot be outlined.\n");
+        return false;
+    }
+    // Apart from the IV, the inputs must be available before the loop: they are stored in the context
+    SetVector<Value*> Inputs, Outputs, Allocas;
+    CE.findInputsOutputs(Inputs, Outputs, Allocas);
+    if (!Outputs.empty() || any_of(Inputs, [&](Value *V) {
+            auto *I = dyn_cast<Instruction>(V);
+            return V != IV && I && L->contains(I);
+        })) {
+        LLVM_DEBUG(dbgs() << "Body of blocking loop " << L->getName() << " depends on values computed in the loop.\n");
         return false;
     }
 
-    SmallVector<Loop*> Inner(BN.begin()+FirstLoopDepth, BN.end());
-    DenseMap<Loop*, std::unique_ptr<Loop::LoopBounds>> BoundsMap;
-    // Finally check dominance for bounds
-    for (Loop *L : Inner) {
-        Optional<Loop::LoopBounds> Bounds = L->getBounds(SE);
-        if (!Bounds) {
-            LLVM_DEBUG(dbgs() << "Loop: " << L->getName() << "bounds info could not be computed!\n");
-            return false;
-        }
-        if (!checkBoundaryValuesDominance(*Bounds, L->getHeader(), DT, SE)) {
-            LLVM_DEBUG(dbgs() << "Loop: " << L->getName() << "bounds do not dominate parent header!\n");
-            BoundsNotDominant++;
-            return false;
-        }
-        if ((*Bounds).getDirection() == Loop::LoopBounds::Direction::Unknown) {
-            LLVM_DEBUG(dbgs() << "Loop: " <<  L->getName() << ": direction unknown\n");
-            return false;
+    CodeExtractorAnalysisCache CEAC(ParentFunc);
+    Inputs.clear();
+    Function *Outlined = CE.extractCodeRegion(CEAC, Inputs, Outputs);
+    if (!Outlined)
+        return false;
+    Outlined->addFnAttr(OutlinedAttr);
+    LLVM_DEBUG(dbgs() << "Outlined body of blocking loop " << L->getName() << " to " << Outlined->getName() << '\n');
+
+    // Trampoline: void Outlined.par(i64 IV, i8 *Ctx)
+    Module *M = ParentFunc.getParent();
+    LLVMContext &Ctx = ParentFunc.getContext();
+    Type *CtxPtrTy = Type::getInt8PtrTy(Ctx);
+    SmallVector<Type*, 8> CtxTypes;
+    for (Value *In : Inputs)
+        if (In != IV)
+            CtxTypes.push_back(In->getType());
+    StructType *CtxTy = StructType::get(Ctx, CtxTypes);
+    FunctionType *BodyTy = FunctionType::get(Type::getVoidTy(Ctx), {Int64Ty, CtxPtrTy}, false);
+    Function *Trampoline = Function::Create(BodyTy, GlobalValue::InternalLinkage, Outlined->getName() + ".par", M);
+    Trampoline->addFnAttr(OutlinedAttr);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Trampoline);
+    Value *TrampIV = new TruncInst(Trampoline->getArg(0), IV->getType(), "iv", Entry);
+    if (IV->getType() == Int64Ty) {
+        cast<Instruction>(TrampIV)->eraseFromParent();
+        TrampIV = Trampoline->getArg(0);
+    }
+    Value *TrampCtx = new BitCastInst(Trampoline->getArg(1), CtxTy->getPointerTo(), "ctx", Entry);
+    SmallVector<Value*, 8> Args;
+    unsigned Field = 0;
+    for (Value *In : Inputs) {
+        if (In == IV) {
+            Args.push_back(TrampIV);
+            continue;
         }
-        BoundsMap[L] = std::make_unique<Loop::LoopBounds>(std::move(*Bounds));
+        Value *Ptr = GetElementPtrInst::CreateInBounds(CtxTy, TrampCtx,
+            {ConstantInt::get(Type::getInt32Ty(Ctx), 0), ConstantInt::get(Type::getInt32Ty(Ctx), Field)}, "", Entry);
+        Args.push_back(new LoadInst(CtxTypes[Field], Ptr, In->getName(), Entry));
+        Field++;
     }
-    
-    blockingAnalysis(BN);
+    CallInst::Create(Outlined, Args, "", Entry);
+    ReturnInst::Create(Ctx, Entry);
 
-    Loop *TopLoop = BN.topLoop();
+    // Fill the context before the loop and call the runtime instead of running the loop
+    Instruction *InsertPt = Preheader->getTerminator();
+    AllocaInst *CtxAlloca = new AllocaInst(CtxTy, M->getDataLayout().getAllocaAddrSpace(), "blocking.ctx",
+                                           &*ParentFunc.getEntryBlock().getFirstInsertionPt());
+    Field = 0;
+    for (Value *In : Inputs) {
+        if (In == IV)
+            continue;
+        Value *Ptr = GetElementPtrInst::CreateInBounds(CtxTy, CtxAlloca,
+            {ConstantInt::get(Type::getInt32Ty(Ctx), 0), ConstantInt::get(Type::getInt32Ty(Ctx), Field++)}, "", InsertPt);
+        new StoreInst(In, Ptr, InsertPt);
+    }
+    Value *Lower = CastInst::CreateSExtOrBitCast(Start, Int64Ty, "blocking.par.lb", InsertPt);
+    Value *Upper = CastInst::CreateSExtOrBitCast(End, Int64Ty, "blocking.par.ub", InsertPt);
+    if (Pred == CmpInst::ICMP_SLE)
+        Upper = BinaryOperator::CreateNSWAdd(Upper, ConstantInt::get(Int64Ty, 1), "blocking.par.ub", InsertPt);
+    Value *Step = ConstantInt::get(Int64Ty, cast<ConstantInt>(Update->getOperand(1))->getSExtValue());
+    FunctionCallee ParallelFor = M->getOrInsertFunction(ParallelForName, Type::getVoidTy(Ctx), Int64Ty, Int64Ty, Int64Ty,
+                                                        BodyTy->getPointerTo(), CtxPtrTy);
+    CallInst::Create(ParallelFor, {Lower, Upper, Step, Trampoline, new BitCastInst(CtxAlloca, CtxPtrTy, "", InsertPt)},
+                     "", InsertPt);
 
+    // The loop is left unreachable: the exit now comes right after the call
+    for (PHINode &PN : Exit->phis())
+        PN.addIncoming(PN.getIncomingValueForBlock(Header), Preheader);
+    ReplaceInstWithInst(InsertPt, BranchInst::Create(Exit));
+    removeUnreachableBlocks(ParentFunc);
+    DT.recalculate(ParentFunc);
+    return true;
+}
 
-    // All the legality checks are complete, now we can create the new blocking loop.
-    
-    for (auto it = Inner.rbegin(); it != Inner.rend(); it++) {
-        LLVM_DEBUG(dbgs() << "Considering loop: \n"; (*it)->print(dbgs().indent(4), false, false););
-        auto info = BlockingInfo(BlockingFactor);
-        
-        Loop* BlockingLoop = createBlockingLoop(*it, TopLoop, *(BoundsMap[*it]), info);
-        // Update the analysis
-        if (!TopLoop->getParentLoop())
-            LI.addTopLevelLoop(BlockingLoop);
-
-        for (auto it = LI.begin(); it != LI.end(); it++) {
-            if (*it == TopLoop) {
-                LI.removeLoop(it);
-                break;
+bool LoopBlocking::prepareNest(Loop *L)
+{
+    // A nest is perfect when nothing but the control flow of the loops is between the headers of two nested loops.
+    // Instructions found there are hoisted out of the outer loop when they are invariant in it, or sunk into the header
+    // of the inner loop when they have no side effects and are only used inside it. Inner loops are prepared first,
+    // so that code hoisted out of them can move further out; code is then sunk straight into the innermost loop
+    // of the nest with all its users, since the loops below are not prepared again.
+    bool Changed = false;
+    for (Loop *Sub : *L)
+        Changed |= prepareNest(Sub);
+    if (L->getSubLoops().size() != 1 || !L->getLoopPreheader())
+        return Changed;
+    Loop *Inner = L->getSubLoops().front();
+    BasicBlock *InnerPreheader = Inner->getLoopPreheader();
+    if (!InnerPreheader)
+        return Changed;
+
+    SmallVector<BasicBlock*, 2> Between = {L->getHeader()};
+    if (InnerPreheader != L->getHeader())
+        Between.push_back(InnerPreheader);
+    SmallVector<Instruction*, 8> Moved;
+    for (BasicBlock *BB : Between) {
+        SmallVector<Instruction*, 8> Insts;
+        for (Instruction &I : *BB)
+            if (!I.isTerminator() && !isa<PHINode>(I) && !isa<DbgInfoIntrinsic>(I))
+                Insts.push_back(&I);
+        // Users come after their operands: they are sunk first, and end up after them at the start of the inner header
+        for (Instruction *I : reverse(Insts)) {
+            // Operands of an instruction hoisted before
+            if (I->getParent() != BB)
+                continue;
+            bool Hoisted = false;
+            if (L->makeLoopInvariant(I, Hoisted)) {
+                HoistedInstructions++;
+                Moved.push_back(I);
+                continue;
             }
+            if (I->mayReadOrWriteMemory() || !isSafeToSpeculativelyExecute(I))
+                continue;
+            auto UsedOnlyIn = [&](Loop *Target) {
+                return all_of(I->users(), [&](User *U) { return !isa<PHINode>(U) && Target->contains(cast<Instruction>(U)); });
+            };
+            if (!UsedOnlyIn(Inner))
+                continue;
+            Loop *Target = Inner;
+            while (Target->getSubLoops().size() == 1 && UsedOnlyIn(Target->getSubLoops().front()))
+                Target = Target->getSubLoops().front();
+            LLVM_DEBUG(dbgs() << "Sinking into the loop " << Target->getName() << ":"; I->print(dbgs()); dbgs() << '\n');
+            I->moveBefore(&*Target->getHeader()->getFirstInsertionPt());
+            SunkInstructions++;
+            Moved.push_back(I);
         }
-        for (auto* BB : TopLoop->blocks())
-            BlockingLoop->addBlockEntry(BB);
-        
-        BlockingLoop->addChildLoop(TopLoop);
-        SE.forgetLoop(*it);
-        TopLoop = BlockingLoop;
-        #ifndef NDEBUG
-        BlockingLoop->verifyLoop();
-        #endif
     }
-    
-    
-    #ifndef NDEBUG
-    LI.verify(DT);
-    assert(DT.verify() && "DomTree is broken!");
-    #endif
-
-    return true;
+    // forgetLoopDispositions would drop the dispositions of every loop of the function, once per prepared nest:
+    // only the moved instructions, and the values computed from them, change disposition
+    if (!Moved.empty()) {
+        SE.forgetLoop(L);
+        for (Instruction *I : Moved)
+            SE.forgetValue(I);
+    }
+    return Changed || !Moved.empty();
 }
 
-SmallVector<BlockingNest> LoopBlocking::collectCandidates(ArrayRef<Loop*> const& loopsVector)
+SmallVector<BlockingNest> LoopBlocking::collectCandidates(ArrayRef<Loop*> Loops, unsigned FirstSlot)
 {
     // Collect all loops that may be candidate for blocking
     LLVM_DEBUG(dbgs() << "Checking candidates...\n");
     SmallVector<BlockingNest> nests;
-    for (Loop* L : loopsVector) {
-        std::unique_ptr<LoopNest> Nest = LoopNest::getLoopNest(*L, SE);
-        // take all the perfect loop nest of depth 3 max
-        auto PerfetcNests = Nest->getPerfectLoops(SE);
-        for (LoopVectorTy &N : PerfetcNests) {
-            unsigned PerfectNestDepth = N.size();
-            if (PerfectNestDepth >= 2U && PerfectNestDepth <= MaxPerfectNestDepth)
-                nests.push_back(BlockingNest(std::move(N)));
-        }
+    for (unsigned Slot = FirstSlot; Slot < FirstSlot + Loops.size(); Slot++) {
+        Loop *L = Loops[Slot - FirstSlot];
+        unsigned NumNests = nests.size();
+        collectPerfectNests(L, Slot, nests);
+        if (nests.size() == NumNests && !L->isInnermost())
+            remarkMissed(L, "NoPerfectNest", "no perfect nest of depth 2 to " + std::to_string(MaxPerfectNestDepth) + " in the loop");
+        for (unsigned Idx = NumNests; Idx < nests.size(); Idx++)
+            nests[Idx].setID(getNestID(nests[Idx].topLoop(), Slot, Idx - NumNests));
     }
     LLVM_DEBUG(dbgs() << "Collected " << nests.size() << " candidates\n");
     return nests;
 }
 
-Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBounds const& TargetBounds, BlockingInfo& Info)
+void LoopBlocking::collectPerfectNests(Loop *L, unsigned Slot, SmallVectorImpl<BlockingNest> &Nests)
 {
+    // Same nests as LoopNest::getPerfectLoops, without building a LoopNest for every loop of the function:
+    // the nest starting at L goes down while a loop has a single subloop perfectly nested in it,
+    // the loops inside the innermost one start new nests
+    LoopVectorTy Nest = {L};
+    while (Nest.back()->getSubLoops().size() == 1 &&
+           LoopNest::arePerfectlyNested(*Nest.back(), *Nest.back()->getSubLoops().front(), SE))
+        Nest.push_back(Nest.back()->getSubLoops().front());
+    std::vector<Loop*> const& Inner = Nest.back()->getSubLoops();
+    // take all the perfect loop nest of depth 3 max
+    if (Nest.size() >= 2U && Nest.size() <= MaxPerfectNestDepth) {
+        Nests.push_back(BlockingNest(std::move(Nest)));
+        Nests.back().setSlot(Slot);
+    }
+    for (unsigned SubSlot = 0; SubSlot < Inner.size(); SubSlot++)
+        collectPerfectNests(Inner[SubSlot], SubSlot, Nests);
+}
+
+Loop* LoopBlocking::createBlockingLoop(BlockedLoop &BL, Loop *Outer, unsigned Factor)
+{
+    // The target is the loop iterating inside the new blocks: the blocked loop itself for the first level,
+    // the blocking loop of the level below otherwise
+    BlockingLevel *InnerLevel = BL.Levels.empty() ? nullptr : &BL.Levels.back();
+    Loop *Target = InnerLevel ? InnerLevel->BlockingLoop : BL.L;
+    Loop::LoopBounds const& TargetBounds = *BL.Bounds;
     assert(Target && "Target loop not valid!");
     assert(Outer && "Outer loop not valid!");
-    assert(Target->isRotatedForm() && "Target loop is not in rotated form!");
+    assert((InnerLevel || Target->isRotatedForm()) && "Target loop is not in rotated form!");
     assert(Target->isLoopSimplifyForm() && "Target loop is not in simplified form!");
+    assert((!InnerLevel || Factor % InnerLevel->Factor == 0) && "Blocks must be made of whole inner blocks!");
     BasicBlock *OuterHeader = Outer->getHeader();
     BasicBlock *OuterPreheader = Outer->getLoopPreheader();
     BasicBlock *OuterLatch = Outer->getLoopLatch();
@@ -201,14 +1909,13 @@ Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBoun
     assert(OuterPreheader && "Invalid preheader for outer loop.");
 
     BasicBlock *TargetLatch = Target->getLoopLatch();
-    BasicBlock *TargetPreheader = Target->getLoopPreheader();
     assert(TargetLatch && "Invalid latch for target loop.");
-    assert(TargetPreheader && "Invalid preheader for target loop.");
 
     BasicBlock *OuterExiting = Outer->getExitingBlock();
     assert(OuterExiting && "Outer loop has more than one exiting block.");
 
-    PHINode *TargetIv = Target->getInductionVariable(SE);
+    // SCEV is not queried: it relies on the dominator tree, which is only updated once all the blocking loops are created
+    PHINode *TargetIv = InnerLevel ? InnerLevel->BlockIV : BL.IV;
     assert(TargetIv && "Target induction variable not available");
     // Tell LoopInfo to allocate a new loop: this loop will provide the blocking to the candidate
     Loop* NL = LI.AllocateLoop();
@@ -230,10 +1937,6 @@ Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBoun
     BranchInst* OldParentPreheaderTerminator = cast<BranchInst>(OuterPreheader->getTerminator());
     assert(OldParentPreheaderTerminator->isUnconditional() && "Old parent preheader terminator is not an unconditional branch!");
     OldParentPreheaderTerminator->replaceSuccessorWith(OuterHeader, NewHeader);
-    DT.addNewBlock(NewHeader, OuterPreheader);
-    LLVM_DEBUG(dbgs() << "adding new block to domtree: Block: ";
-                    NewHeader->printAsOperand(dbgs()); dbgs() << " IDom: ";
-                    OuterPreheader->printAsOperand(dbgs()); dbgs() << '\n';);
 
     // new preheader for outer loop is empty and jumps directly to outer header
     BranchInst::Create(OuterHeader, NewOuterPreheader);
@@ -249,23 +1952,20 @@ Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBoun
     // which is non in rotated form, so its latch will have a header as predecessor
     OuterExiting->getTerminator()->replaceSuccessorWith(OuterExit, NewLatch);
 
-    DT.addNewBlock(NewLatch, OuterExiting);
-    LLVM_DEBUG(dbgs() << "adding new block to domtree: Block: ";
-                    NewLatch->printAsOperand(dbgs()); dbgs() << " IDom: ";
-                    OuterExiting->printAsOperand(dbgs()); dbgs() << '\n';);
-
-    
     // New latch branches to the new header
     BranchInst* NewLatchTerminator = BranchInst::Create(NewHeader, NewLatch);
     // Latch is only missing the update instruction on the IV
     // we create the iv and momentarily put it at the end of the new loop header
     PHINode* NewIV = PHINode::Create(TargetIv->getType(), 2, "blocking.loop.IV", NewHeader);
-    // update lower bound of target induction variable
+    // update lower bound of target induction variable.
+    // The target preheader is looked up now: when the target is the outer loop itself, it has just been replaced
+    BasicBlock *TargetPreheader = Target->getLoopPreheader();
+    assert(TargetPreheader && "Invalid preheader for target loop.");
     TargetIv->setIncomingValueForBlock(TargetPreheader, NewIV);
     // create update and insert it before the new latch terminator
-    // blocking factor should have the same type as the new IV
-    Constant* BlockingFactor = ConstantInt::getIntegerValue(NewIV->getType(), 
-                                                                APInt(NewIV->getType()->getIntegerBitWidth(), Info.getBlockingFactor()));
+    // blocking factor should have the same type as the new IV: a block spans BlockingFactor iterations of the target
+    int64_t TargetStep = cast<ConstantInt>(TargetBounds.getStepValue())->getSExtValue();
+    Constant* BlockingFactor = ConstantInt::get(NewIV->getType(), Factor * TargetStep);
     BinaryOperator* UpdateIVInst = BinaryOperator::CreateAdd(NewIV, BlockingFactor, "blocking.loop.update.IV", NewLatchTerminator);
 
     // NOTE: C.ParentPreheader has become the blocking loop preheader!
@@ -275,41 +1975,29 @@ Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBoun
     // Now we need the compare instruction for the new loop exit condition.
     // the comparison will be: NewIV < C.UB
     CmpInst* NewHeaderExitCond = CmpInst::Create(Instruction::OtherOps::ICmp, 
-                                        TargetBounds.getCanonicalPredicate(), 
+                                        BL.Predicate, 
                                         NewIV, &TargetBounds.getFinalIVValue(), 
                                         "new.header.exit.cond",
                                         NewHeader);
     // this comparison will determine the condition of the branch instruction
     // blocking loop header terminator points to the parent loop header if true or to the parent loop exit if false
     BranchInst::Create(NewOuterPreheader, OuterExit, NewHeaderExitCond, NewHeader);
-    DT.addNewBlock(NewOuterPreheader, NewHeader);
-    DT.insertEdge(NewOuterPreheader, OuterHeader);
-    DT.insertEdge(NewHeader, OuterExit);
-    DT.deleteEdge(OuterExiting, OuterExit);
-    DT.deleteEdge(OuterPreheader, OuterHeader);
+    assert(OuterExit->getSinglePredecessor() == NewHeader && "Outer loop exit is not dedicated!");
 
-    // Starting in the candidate preheader, a new value has to be create to provide an additional boundary check in the candiate header.
+    // At the start of each block a new value has to be created to provide an additional boundary check in the target latch.
     // This boundary is that of the "end" of the iteration block in which the loop is currently iterating inside.
-    // get the update instruction for TargetIV
-    Instruction::BinaryOps BoundOp;
-    switch (TargetBounds.getDirection()) {
-        case Loop::LoopBounds::Direction::Increasing:
-            BoundOp = Instruction::BinaryOps::Add;
-            break;
-        case Loop::LoopBounds::Direction::Decreasing:
-            BoundOp = Instruction::BinaryOps::Sub;
-            break;
-        case Loop::LoopBounds::Direction::Unknown:
-        default:
-            llvm_unreachable("Cannot handle unknown loop direction!");
-    }
-    BinaryOperator *BoundValue = BinaryOperator::Create(BoundOp,
-                                                        NewIV, BlockingFactor, 
+    // It only depends on the blocking IV, so it is computed once per block, before entering the nest.
+    // With a non-strict predicate the end is the last iteration of the block instead of the first of the next one.
+    Value *BlockEndOffset = BlockingFactor;
+    if (CmpInst::isNonStrictPredicate(BL.Predicate))
+        BlockEndOffset = ConstantInt::get(NewIV->getType(), Factor * TargetStep - 1);
+    BinaryOperator *BoundValue = BinaryOperator::Create(Instruction::BinaryOps::Add,
+                                                        NewIV, BlockEndOffset, 
                                                         "blocking.bound.value", 
-                                                        TargetPreheader->getTerminator());
-    // select the right intrinsic function ID to call based on sign of types
+                                                        NewOuterPreheader->getTerminator());
+    // select the right intrinsic function ID to call based on sign of the comparison
     Intrinsic::ID IntrFuncMinID;
-    if (Target->getLatchCmpInst()->isSigned())
+    if (CmpInst::isSigned(BL.Predicate))
         IntrFuncMinID = Intrinsic::smin;
     else
         IntrFuncMinID = Intrinsic::umin;
@@ -319,24 +2007,494 @@ Loop* LoopBlocking::createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBoun
     SmallVector<Value*, 2> Args;
     Args.push_back(BoundValue);
     Args.push_back(&TargetBounds.getFinalIVValue());
-    CallInst *MinIntrCall = CallInst::Create(MinFuncIntrinsic, Args, "min.val", TargetLatch->getTerminator());
+    CallInst *MinIntrCall = CallInst::Create(MinFuncIntrinsic, Args, "min.val", NewOuterPreheader->getTerminator());
     
-    // create the new compare instruction: this will be added in the latch.
-    // need to erase the old one...
-    // FIXME: check if getCanonicalPredicate will return the right predicate for this case
-    // NOTE: OldLatchCompInst->getOperand(0) represents the update of TargetIV that happens before the bound check
-    auto OldLatchCompInst = Target->getLatchCmpInst();
-    CmpInst* BlockBoundCond = CmpInst::Create(Target->getLatchCmpInst()->getOpcode(),
-                                         TargetBounds.getCanonicalPredicate(), 
-                                         OldLatchCompInst->getOperand(0), MinIntrCall, 
-                                         "blocking.bound.check", 
-                                         TargetLatch->getTerminator());
-    // set it as the condition in the terminator instr
-    cast<BranchInst>(TargetLatch->getTerminator())->setCondition(BlockBoundCond);
-    OldLatchCompInst->eraseFromParent();
+    if (InnerLevel) {
+        // The blocking loop below is tested in its header: it now stops at the end of the new block
+        InnerLevel->ExitCond->setOperand(1, MinIntrCall);
+    } else {
+        // create the new compare instruction: this will be added in the latch.
+        // need to erase the old one...
+        // The canonical form compares the update of TargetIV, which happens before the bound check, with the bound:
+        // the loop keeps iterating while the comparison is true
+        auto OldLatchCompInst = Target->getLatchCmpInst();
+        CmpInst* BlockBoundCond = CmpInst::Create(Instruction::OtherOps::ICmp,
+                                             BL.Predicate, 
+                                             &TargetBounds.getStepInst(), MinIntrCall, 
+                                             "blocking.bound.check", 
+                                             TargetLatch->getTerminator());
+        // set it as the condition in the terminator instr
+        BranchInst *TargetLatchBr = cast<BranchInst>(TargetLatch->getTerminator());
+        TargetLatchBr->setCondition(BlockBoundCond);
+        if (TargetLatchBr->getSuccessor(0) != Target->getHeader())
+            TargetLatchBr->swapSuccessors();
+        if (OldLatchCompInst->use_empty())
+            OldLatchCompInst->eraseFromParent();
+    }
+
+    BL.Levels.push_back({Factor, NL, NewIV, MinIntrCall, BoundValue, NewHeaderExitCond});
     return NL;
 }
 
+void LoopBlocking::skewBlocks(MutableArrayRef<BlockedLoop> Band)
+{
+    // The blocks of a skewed loop are taken along IV + Skew * IV0: the blocking loop spans the skewed iteration space,
+    // the loop inside the block runs on the part of the block that falls in the original one, which may be empty.
+    //     for (t = LB + Skew * LB0; t < UB + Skew * (UB0 - 1); t += F)
+    //         ...
+    //             for (iv = max(LB, t - Skew * iv0); iv < min(UB, t + F - Skew * iv0); iv++)
+    BlockedLoop &First = Band.front();
+    Type *IVType = First.Levels.front().BlockIV->getType();
+    Function *SMax = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smax, {IVType});
+    Function *SMin = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smin, {IVType});
+    Instruction *TopInsert = First.Levels.front().BlockingLoop->getLoopPreheader()->getTerminator();
+    PHINode *IV0 = First.L->getInductionVariable(SE);
+    assert(IV0 && "Outermost induction variable not available");
+    Value *LB0 = &First.Bounds->getInitialIVValue();
+    Value *Last0 = BinaryOperator::CreateNSWSub(&First.Bounds->getFinalIVValue(), ConstantInt::get(IVType, 1), "skew.last", TopInsert);
+
+    for (BlockedLoop &BL : drop_begin(Band)) {
+        if (!BL.Skew)
+            continue;
+        BlockingLevel &Level = BL.Levels.front();
+        Constant *SkewFactor = ConstantInt::get(IVType, BL.Skew);
+        Value *LB = &BL.Bounds->getInitialIVValue();
+        Value *UB = &BL.Bounds->getFinalIVValue();
+        Value *SkewedStart = BinaryOperator::CreateNSWAdd(LB, BinaryOperator::CreateNSWMul(SkewFactor, LB0, "", TopInsert),
+                                                          "skew.start", TopInsert);
+        Value *SkewedEnd = BinaryOperator::CreateNSWAdd(UB, BinaryOperator::CreateNSWMul(SkewFactor, Last0, "", TopInsert),
+                                                        "skew.end", TopInsert);
+        Level.BlockIV->setIncomingValueForBlock(Level.BlockingLoop->getLoopPreheader(), SkewedStart);
+        Level.ExitCond->setOperand(1, SkewedEnd);
+
+        BasicBlock *Guard = BL.L->getLoopPreheader();
+        Instruction *GuardInsert = Guard->getTerminator();
+        Value *Shift = BinaryOperator::CreateNSWMul(SkewFactor, IV0, "skew.shift", GuardInsert);
+        Value *Low = BinaryOperator::CreateNSWSub(Level.BlockIV, Shift, "", GuardInsert);
+        Value *High = BinaryOperator::CreateNSWSub(Level.FullBlockEnd, Shift, "", GuardInsert);
+        Value *Start = CallInst::Create(SMax, {Low, LB}, "skew.iv.start", GuardInsert);
+        Value *End = CallInst::Create(SMin, {High, UB}, "skew.iv.end", GuardInsert);
+        guardBlockedLoop(BL, Start, End);
+    }
+}
+
+void LoopBlocking::boundNonRectangularBlocks(MutableArrayRef<BlockedLoop> Band)
+{
+    // The blocking loop of a non-rectangular loop spans the lowest lower bound and the highest upper bound
+    // over the values the outer IV takes while it runs: a block of it, or its whole range if it is not blocked.
+    // The loop inside the block runs on the part of the block within its own bounds, which may be empty.
+    //     for (t0 = ...; t0 < ...; t0 += F0)
+    //         for (t = min(LB(t0), LB(last0)); t < max(UB(t0), UB(last0)); t += F)
+    //             for (iv0 = t0; iv0 <= last0; iv0++)
+    //                 for (iv = max(t, LB(iv0)); iv < min(t + F, UB(iv0)); iv++)
+    SCEVExpander Expander(SE, ParentFunc.getParent()->getDataLayout(), "blocking.bound");
+    for (BlockedLoop &BL : Band) {
+        if (!BL.BoundDepth || BL.Levels.empty())
+            continue;
+        BlockedLoop const& Outer = Band[*BL.BoundDepth - FirstLoopDepth];
+        BlockingLevel &Level = BL.Levels.front();
+        Type *IVType = Level.BlockIV->getType();
+        Instruction *TileInsert = Level.BlockingLoop->getLoopPreheader()->getTerminator();
+        const SCEV *One = SE.getOne(IVType);
+        const SCEV *OuterStart = SE.getSCEV(&Outer.Bounds->getInitialIVValue());
+        const SCEV *OuterFirst = OuterStart;
+        // The end of the outer loop, and of its blocks, is its last iteration for a non-strict predicate
+        const SCEV *OuterEnd = SE.getSCEV(&Outer.Bounds->getFinalIVValue());
+        if (!Outer.Levels.empty()) {
+            OuterFirst = SE.getUnknown(Outer.Levels.front().BlockIV);
+            OuterEnd = SE.getUnknown(Outer.Levels.front().BlockEnd);
+        }
+        const SCEV *OuterLast = CmpInst::isNonStrictPredicate(Outer.Predicate) ? OuterEnd : SE.getMinusSCEV(OuterEnd, One);
+        // Value of a bound for a value of the outer IV: the bounds that do not depend on it are invariant
+        auto BoundAt = [&](const SCEV *Bound, Value *Original, const SCEV *OuterIV, Instruction *Insert) -> Value* {
+            if (!Bound)
+                return Original;
+            auto *AR = dyn_cast<SCEVAddRecExpr>(Bound);
+            if (!AR)
+                return Expander.expandCodeFor(Bound, IVType, Insert);
+            const SCEV *Iteration = SE.getMinusSCEV(OuterIV, OuterStart);
+            return Expander.expandCodeFor(SE.getAddExpr(AR->getStart(), SE.getMulExpr(AR->getStepRecurrence(SE), Iteration)), IVType, Insert);
+        };
+        auto IsIncreasing = [&](const SCEV *Bound) {
+            auto *AR = dyn_cast_or_null<SCEVAddRecExpr>(Bound);
+            return !AR || cast<SCEVConstant>(AR->getStepRecurrence(SE))->getAPInt().isNonNegative();
+        };
+        Value *LB = &BL.Bounds->getInitialIVValue();
+        Value *UB = &BL.Bounds->getFinalIVValue();
+        Value *TileStart = BoundAt(BL.Lower, LB, IsIncreasing(BL.Lower) ? OuterFirst : OuterLast, TileInsert);
+        Value *TileEnd = BoundAt(BL.Upper, UB, IsIncreasing(BL.Upper) ? OuterLast : OuterFirst, TileInsert);
+        Level.BlockIV->setIncomingValueForBlock(Level.BlockingLoop->getLoopPreheader(), TileStart);
+        Level.ExitCond->setOperand(1, TileEnd);
+
+        PHINode *OuterIV = Outer.L->getInductionVariable(SE);
+        assert(OuterIV && "Outer induction variable not available");
+        Instruction *GuardInsert = BL.L->getLoopPreheader()->getTerminator();
+        Function *SMax = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smax, {IVType});
+        Function *SMin = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smin, {IVType});
+        Value *PointLB = BoundAt(BL.Lower, LB, SE.getUnknown(OuterIV), GuardInsert);
+        Value *PointUB = BoundAt(BL.Upper, UB, SE.getUnknown(OuterIV), GuardInsert);
+        Value *Start = CallInst::Create(SMax, {Level.BlockIV, PointLB}, "block.iv.start", GuardInsert);
+        Value *End = CallInst::Create(SMin, {Level.FullBlockEnd, PointUB}, "block.iv.end", GuardInsert);
+        guardBlockedLoop(BL, Start, End);
+    }
+}
+
+void LoopBlocking::guardBlockedLoop(BlockedLoop &BL, Value *Start, Value *End)
+{
+    // The loop inside the block runs on [Start, End), computed in its preheader, instead of the whole block.
+    // The old preheader becomes a guard that skips the loop when the range is empty:
+    // the exit gets a new dedicated block and the loop a new preheader.
+    BlockingLevel &Level = BL.Levels.front();
+    BasicBlock *Guard = BL.L->getLoopPreheader();
+    PHINode *IV = BL.L->getInductionVariable(SE);
+    assert(IV && "Induction variable not available");
+    IV->setIncomingValueForBlock(Guard, Start);
+    BL.L->getLatchCmpInst()->setOperand(1, End);
+    // The end of the block is not a bound of the loop anymore
+    if (Instruction *BlockEnd = dyn_cast_or_null<Instruction>(Level.BlockEnd)) {
+        if (BlockEnd->use_empty()) {
+            BlockEnd->eraseFromParent();
+            Level.BlockEnd = nullptr;
+        }
+    }
+
+    BasicBlock *Exiting = BL.L->getExitingBlock();
+    BasicBlock *Exit = BL.L->getExitBlock();
+    BasicBlock *DedicatedExit = BasicBlock::Create(ParentFunc.getContext(), "block.guard.exit", &ParentFunc, Exit);
+    BranchInst::Create(Exit, DedicatedExit);
+    Exiting->getTerminator()->replaceSuccessorWith(Exit, DedicatedExit);
+    if (Loop *ExitLoop = LI.getLoopFor(Exit))
+        ExitLoop->addBasicBlockToLoop(DedicatedExit, LI);
+    DT.addNewBlock(DedicatedExit, Exiting);
+    BasicBlock *Preheader = SplitBlock(Guard, Guard->getTerminator(), &DT, &LI, nullptr, "block.guard.ph");
+    ICmpInst *NotEmpty = new ICmpInst(Guard->getTerminator(), CmpInst::ICMP_SLT, Start, End, "block.not.empty");
+    ReplaceInstWithInst(Guard->getTerminator(), BranchInst::Create(Preheader, Exit, NotEmpty));
+    DT.changeImmediateDominator(Exit, Guard);
+}
+
+BlockingLevel LoopBlocking::createWavefront(MutableArrayRef<BlockedLoop> Band)
+{
+    // The blocks of the two outermost loops are visited by anti-diagonals: after skewing, every dependence between
+    // different blocks goes to a later anti-diagonal, so the blocks of an anti-diagonal can run in any order.
+    //     for (w = 0; w < N0 + N1 - 1; w++)
+    //         for (a = max(0, w - N1 + 1); a < min(N0, w + 1); a++)
+    //             t0 = S0 + a * F0; t1 = S1 + (w - a) * F1; ...
+    BlockingLevel &Outer = Band[0].Levels.front();
+    BlockingLevel &Inner = Band[1].Levels.front();
+    Type *IVType = Outer.BlockIV->getType();
+    Function *SMax = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smax, {IVType});
+    Function *SMin = Intrinsic::getDeclaration(ParentFunc.getParent(), Intrinsic::smin, {IVType});
+    Constant *Zero = ConstantInt::get(IVType, 0);
+    Constant *One = ConstantInt::get(IVType, 1);
+
+    BasicBlock *TopPreheader = Outer.BlockingLoop->getLoopPreheader();
+    BasicBlock *OuterPreheader = Inner.BlockingLoop->getLoopPreheader();
+    BasicBlock *InnerPreheader = cast<BranchInst>(Inner.BlockingLoop->getHeader()->getTerminator())->getSuccessor(0);
+    BinaryOperator *OuterUpdate = cast<BinaryOperator>(Outer.BlockIV->getIncomingValueForBlock(Outer.BlockingLoop->getLoopLatch()));
+    BinaryOperator *InnerUpdate = cast<BinaryOperator>(Inner.BlockIV->getIncomingValueForBlock(Inner.BlockingLoop->getLoopLatch()));
+    Value *OuterStart = Outer.BlockIV->getIncomingValueForBlock(TopPreheader);
+    Value *InnerStart = Inner.BlockIV->getIncomingValueForBlock(OuterPreheader);
+
+    // Number of blocks along each loop
+    Instruction *TopInsert = TopPreheader->getTerminator();
+    auto NumBlocks = [&](Value *Start, Value *End, Value *Size, const Twine &Name) -> Value* {
+        Value *Span = CallInst::Create(SMax, {BinaryOperator::CreateNSWSub(End, Start, "", TopInsert), Zero}, "", TopInsert);
+        Constant *Round = ConstantInt::get(IVType, cast<ConstantInt>(Size)->getSExtValue() - 1);
+        return BinaryOperator::Create(Instruction::SDiv, BinaryOperator::CreateNSWAdd(Span, Round, "", TopInsert), Size, Name, TopInsert);
+    };
+    Value *OuterBlocks = NumBlocks(OuterStart, Outer.ExitCond->getOperand(1), OuterUpdate->getOperand(1), "wave.blocks0");
+    Value *InnerBlocks = NumBlocks(InnerStart, Inner.ExitCond->getOperand(1), InnerUpdate->getOperand(1), "wave.blocks1");
+    Value *WaveEnd = BinaryOperator::CreateNSWSub(BinaryOperator::CreateNSWAdd(OuterBlocks, InnerBlocks, "", TopInsert), One,
+                                                  "wave.end", TopInsert);
+
+    // The first iteration of each block is computed from the anti-diagonal and the position on it
+    Instruction *BlockInsert = &*InnerPreheader->getFirstInsertionPt();
+    BinaryOperator *Diagonal = BinaryOperator::CreateNSWSub(Outer.BlockIV, Inner.BlockIV, "", BlockInsert);
+    BinaryOperator *OuterOffset = BinaryOperator::CreateNSWMul(Inner.BlockIV, OuterUpdate->getOperand(1), "", BlockInsert);
+    Value *OuterBlock = BinaryOperator::CreateNSWAdd(OuterStart, OuterOffset, "wave.block0", BlockInsert);
+    Value *InnerOffset = BinaryOperator::CreateNSWMul(Diagonal, InnerUpdate->getOperand(1), "", BlockInsert);
+    Value *InnerBlock = BinaryOperator::CreateNSWAdd(InnerStart, InnerOffset, "wave.block1", BlockInsert);
+    Outer.BlockIV->replaceUsesWithIf(OuterBlock, [&](Use &U) {
+        return U.getUser() != OuterUpdate && U.getUser() != Outer.ExitCond && U.getUser() != Diagonal;
+    });
+    Inner.BlockIV->replaceUsesWithIf(InnerBlock, [&](Use &U) {
+        return U.getUser() != InnerUpdate && U.getUser() != Inner.ExitCond && U.getUser() != Diagonal && U.getUser() != OuterOffset;
+    });
+    // The end of the outer block depends on it: it moves to the inner preheader too
+    for (Instruction &I : make_early_inc_range(*OuterPreheader))
+        if (!I.isTerminator())
+            I.moveBefore(BlockInsert);
+
+    Outer.BlockIV->setIncomingValueForBlock(TopPreheader, Zero);
+    OuterUpdate->setOperand(1, One);
+    Outer.ExitCond->setOperand(1, WaveEnd);
+    Outer.BlockIV->setName("wave.IV");
+
+    Instruction *DiagonalInsert = OuterPreheader->getTerminator();
+    Value *First = BinaryOperator::CreateNSWAdd(BinaryOperator::CreateNSWSub(Outer.BlockIV, InnerBlocks, "", DiagonalInsert), One, "", DiagonalInsert);
+    Value *DiagonalStart = CallInst::Create(SMax, {First, Zero}, "wave.start", DiagonalInsert);
+    Value *Last = BinaryOperator::CreateNSWAdd(Outer.BlockIV, One, "", DiagonalInsert);
+    Value *DiagonalEnd = CallInst::Create(SMin, {Last, OuterBlocks}, "wave.stop", DiagonalInsert);
+    Inner.BlockIV->setIncomingValueForBlock(OuterPreheader, DiagonalStart);
+    InnerUpdate->setOperand(1, One);
+    Inner.ExitCond->setOperand(1, DiagonalEnd);
+    Inner.BlockIV->setName("wave.block.IV");
+
+    return {1, Inner.BlockingLoop, Inner.BlockIV, DiagonalEnd, nullptr, Inner.ExitCond};
+}
+
+bool LoopBlocking::hasValuesLiveOut(BlockingNest &BN)
+{
+    // The exit of the nest is moved after the blocking loops: nothing must flow out of it
+    Loop *Top = BN.topLoop();
+    for (BasicBlock *BB : Top->blocks())
+        for (Instruction &I : *BB)
+            for (User *U : I.users())
+                if (!Top->contains(cast<Instruction>(U))) {
+                    LLVM_DEBUG(dbgs() << "Value live out of the nest: "; I.print(dbgs()); dbgs() << '\n');
+                    return true;
+                }
+    return false;
+}
+
+bool LoopBlocking::collectMemoryInstructions(BlockingNest &BN, SmallVectorImpl<Instruction*> &MemInsts)
+{
+    // Only plain loads and stores can be analyzed by DependenceInfo
+    for (BasicBlock *BB : BN.topLoop()->blocks()) {
+        for (Instruction &I : *BB) {
+            if (!I.mayReadOrWriteMemory())
+                continue;
+            if (!isa<LoadInst>(I) && !isa<StoreInst>(I)) {
+                LLVM_DEBUG(dbgs() << "Instruction with unknown memory effects: "; I.print(dbgs()); dbgs() << '\n');
+                return false;
+            }
+            if (isa<LoadInst>(I) ? !cast<LoadInst>(I).isSimple() : !cast<StoreInst>(I).isSimple()) {
+                LLVM_DEBUG(dbgs() << "Volatile or atomic memory access: "; I.print(dbgs()); dbgs() << '\n');
+                return false;
+            }
+            MemInsts.push_back(&I);
+        }
+    }
+    return true;
+}
+
+bool LoopBlocking::checkDependences(BlockingNest &BN, SmallVectorImpl<bool> &Carried, SmallVectorImpl<AccessPair> &AliasChecks)
+{
+    // Blocking reorders the iterations of all the loops of the nest: it is legal only if the nest is fully permutable,
+    // that is every dependence not carried by a loop outside the nest has no negative component along the nest loops.
+    // Carried tells, for each loop of the nest, whether any of these dependences has a non-zero component along it.
+    // AliasChecks collects the accesses to different objects that may overlap: they must be checked at run time.
+    Carried.assign(BN.size(), false);
+    SmallVector<Instruction*, 16> MemInsts;
+    if (!collectMemoryInstructions(BN, MemInsts))
+        return false;
+
+    // Dependence levels are numbered from the outermost loop of the function, starting from 1
+    unsigned FirstLevel = BN.topLoop()->getLoopDepth();
+    unsigned LastLevel = FirstLevel + BN.size() - 1;
+    for (unsigned SrcIdx = 0; SrcIdx < MemInsts.size(); SrcIdx++) {
+        for (unsigned DstIdx = SrcIdx; DstIdx < MemInsts.size(); DstIdx++) {
+            Instruction *Src = MemInsts[SrcIdx];
+            Instruction *Dst = MemInsts[DstIdx];
+            if (!isa<StoreInst>(Src) && !isa<StoreInst>(Dst))
+                continue;
+            std::unique_ptr<Dependence> D = DI.depends(Src, Dst, true);
+            if (!D)
+                continue;
+            LLVM_DEBUG(dbgs().indent(2) << "Dependence: "; D->dump(dbgs()));
+            if (D->isConfused()) {
+                if (RuntimeChecks && getUnderlyingObject(getLoadStorePointerOperand(Src)) != getUnderlyingObject(getLoadStorePointerOperand(Dst))) {
+                    LLVM_DEBUG(dbgs() << "Accesses to different objects checked at run time: "; Src->print(dbgs()); dbgs() << " and ";
+                               Dst->print(dbgs()); dbgs() << '\n');
+                    AliasChecks.emplace_back(Src, Dst);
+                    continue;
+                }
+                LLVM_DEBUG(dbgs() << "Confused dependence between "; Src->print(dbgs()); dbgs() << " and "; Dst->print(dbgs()); dbgs() << '\n');
+                return false;
+            }
+            // Expand the direction vector into all the concrete vectors it stands for.
+            // A lexicographically negative vector is the same dependence going from Dst to Src: negate it.
+            unsigned Levels = D->getLevels();
+            SmallVector<unsigned, 8> Dirs;
+            for (unsigned Level = 1; Level <= Levels; Level++)
+                Dirs.push_back(D->getDirection(Level));
+            std::function<bool(unsigned, SmallVectorImpl<unsigned>&)> AllVectorsLegal =
+                [&](unsigned Level, SmallVectorImpl<unsigned> &Vector) -> bool {
+                if (Level == Levels) {
+                    auto Leading = find_if(Vector, [](unsigned Dir) { return Dir != Dependence::DVEntry::EQ; });
+                    if (Leading == Vector.end())
+                        return true;
+                    bool Negate = *Leading == Dependence::DVEntry::GT;
+                    // Carried by a loop enclosing the nest: the order of the nest iterations does not matter
+                    if (unsigned(Leading - Vector.begin()) + 1 < FirstLevel)
+                        return true;
+                    for (unsigned L = FirstLevel; L <= std::min(LastLevel, Levels); L++) {
+                        unsigned Dir = Vector[L - 1];
+                        if (Dir == (Negate ? Dependence::DVEntry::LT : Dependence::DVEntry::GT))
+                            return false;
+                        if (Dir != Dependence::DVEntry::EQ)
+                            Carried[L - FirstLevel] = true;
+                    }
+                    return true;
+                }
+                for (unsigned Dir : {Dependence::DVEntry::LT, Dependence::DVEntry::EQ, Dependence::DVEntry::GT}) {
+                    if (!(Dirs[Level] & Dir))
+                        continue;
+                    Vector.push_back(Dir);
+                    bool Legal = AllVectorsLegal(Level + 1, Vector);
+                    Vector.pop_back();
+                    if (!Legal)
+                        return false;
+                }
+                return true;
+            };
+            SmallVector<unsigned, 8> Vector;
+            if (!AllVectorsLegal(0, Vector)) {
+                LLVM_DEBUG(dbgs() << "Dependence with a negative component between "; Src->print(dbgs()); dbgs() << " and ";
+                           Dst->print(dbgs()); dbgs() << '\n');
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool LoopBlocking::computeSkewFactors(BlockingNest &BN, MutableArrayRef<BlockedLoop> Band)
+{
+    // A dependence with distance (d0, d1, ...) along the band, d0 > 0, becomes non-negative along loop k
+    // once the loop is skewed by ceil(-dk / d0) iterations for each iteration of the outermost loop.
+    // Dependences with d0 = 0 are not changed by skewing: they must already be non-negative.
+    // The skewed bounds are computed with signed arithmetic on unit-step loops covering the whole nest.
+    if (FirstLoopDepth != 0 || Band.size() < 2)
+        return false;
+    Type *IVType = Band.front().Bounds->getInitialIVValue().getType();
+    for (BlockedLoop const& BL : Band) {
+        if (BL.Predicate != CmpInst::ICMP_SLT || !cast<ConstantInt>(BL.Bounds->getStepValue())->isOne() ||
+            BL.Bounds->getInitialIVValue().getType() != IVType) {
+            LLVM_DEBUG(dbgs() << "Loop: " << BL.L->getName() << ": cannot be skewed\n");
+            return false;
+        }
+    }
+    // A skewed block may contain no iteration of an inner loop: the loop is skipped by a branch to its exit
+    for (BlockedLoop const& BL : drop_begin(Band))
+        if (!canGuardLoop(BL.L))
+            return false;
+
+    SmallVector<Instruction*, 16> MemInsts;
+    if (!collectMemoryInstructions(BN, MemInsts))
+        return false;
+
+    unsigned FirstLevel = BN.topLoop()->getLoopDepth();
+    SmallVector<int64_t, MAX_NEST_SIZE> Skews(Band.size(), 0);
+    for (unsigned SrcIdx = 0; SrcIdx < MemInsts.size(); SrcIdx++) {
+        for (unsigned DstIdx = SrcIdx; DstIdx < MemInsts.size(); DstIdx++) {
+            Instruction *Src = MemInsts[SrcIdx];
+            Instruction *Dst = MemInsts[DstIdx];
+            if (!isa<StoreInst>(Src) && !isa<StoreInst>(Dst))
+                continue;
+            std::unique_ptr<Dependence> D = DI.depends(Src, Dst, true);
+            if (!D)
+                continue;
+            if (D->isConfused() || D->getLevels() < FirstLevel + BN.size() - 1)
+                return false;
+            // Carried by a loop enclosing the nest: the order of the nest iterations does not matter
+            unsigned Level = 1;
+            while (Level < FirstLevel && D->getDirection(Level) == Dependence::DVEntry::EQ)
+                Level++;
+            if (Level < FirstLevel && !(D->getDirection(Level) & Dependence::DVEntry::EQ))
+                continue;
+
+            SmallVector<int64_t, MAX_NEST_SIZE> Distance;
+            for (unsigned Depth = 0; Depth < BN.size(); Depth++) {
+                if (D->getDirection(FirstLevel + Depth) == Dependence::DVEntry::EQ) {
+                    Distance.push_back(0);
+                    continue;
+                }
+                auto *Dist = dyn_cast_or_null<SCEVConstant>(D->getDistance(FirstLevel + Depth));
+                if (!Dist) {
+                    LLVM_DEBUG(dbgs() << "Dependence distance is not a constant between "; Src->print(dbgs()); dbgs() << " and ";
+                               Dst->print(dbgs()); dbgs() << '\n');
+                    return false;
+                }
+                Distance.push_back(Dist->getAPInt().getSExtValue());
+            }
+            // A lexicographically negative distance is the same dependence going from Dst to Src: negate it
+            auto Leading = find_if(Distance, [](int64_t Dist) { return Dist != 0; });
+            if (Leading == Distance.end())
+                continue;
+            if (*Leading < 0)
+                for (int64_t &Dist : Distance)
+                    Dist = -Dist;
+            if (Distance[0] == 0) {
+                if (any_of(Distance, [](int64_t Dist) { return Dist < 0; }))
+                    return false;
+                continue;
+            }
+            for (unsigned Depth = 1; Depth < Distance.size(); Depth++)
+                if (Distance[Depth] < 0)
+                    Skews[Depth] = std::max<int64_t>(Skews[Depth], divideCeil(-Distance[Depth], Distance[0]));
+        }
+    }
+    if (all_of(Skews, [](int64_t S) { return S == 0; }))
+        return false;
+
+    LLVM_DEBUG(dbgs() << "Skew factors:"; for (int64_t S : Skews) dbgs() << ' ' << S; dbgs() << '\n');
+    for (unsigned Depth = 0; Depth < Band.size(); Depth++)
+        Band[Depth].Skew = Skews[Depth];
+    return true;
+}
+
+bool LoopBlocking::getAffineBounds(MutableArrayRef<BlockedLoop> Band, Loop *Top)
+{
+    // The bounds of the last loop of the band that are not available before the nest must be affine in the IV
+    // of a single outer loop of the band, with start and step invariant in the nest. That loop must have invariant bounds.
+    // The bounds are recomputed from their SCEV wherever they are needed, so they may be defined anywhere in the nest.
+    // The blocks are clamped with signed min/max on unit steps, and may be empty: the loop is rewritten to test IV < Upper,
+    // where Upper is the final value plus one for a non-strict predicate. Unsigned bounds must be known to be non-negative,
+    // for the signed comparisons to agree with the original ones.
+    BlockedLoop &BL = Band.back();
+    auto IsSupported = [&](BlockedLoop const& L) {
+        if (!cast<ConstantInt>(L.Bounds->getStepValue())->isOne())
+            return false;
+        return CmpInst::isSigned(L.Predicate) || (SE.isKnownNonNegative(SE.getSCEV(&L.Bounds->getInitialIVValue())) &&
+                                                  SE.isKnownNonNegative(SE.getSCEV(&L.Bounds->getFinalIVValue())));
+    };
+    if (!IsSupported(BL) || !canGuardLoop(BL.L))
+        return false;
+    Instruction *TopInsert = Top->getLoopPreheader()->getTerminator();
+    auto GetBound = [&](Value *Bound) -> Optional<const SCEV*> {
+        if (dominantBound(DT, Bound, Top->getHeader()))
+            return nullptr;
+        auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Bound));
+        if (!AR || !AR->isAffine() || !isa<SCEVConstant>(AR->getStepRecurrence(SE)) ||
+            !SE.isLoopInvariant(AR->getStart(), Top) || !isSafeToExpandAt(AR->getStart(), TopInsert, SE))
+            return None;
+        auto Outer = find_if(Band.drop_back(), [&](BlockedLoop const& O) { return O.L == AR->getLoop(); });
+        if (Outer == Band.drop_back().end() || Outer->BoundDepth || !IsSupported(*Outer) ||
+            (BL.BoundDepth && *BL.BoundDepth != Outer->Depth))
+            return None;
+        BL.BoundDepth = Outer->Depth;
+        return AR;
+    };
+    Optional<const SCEV*> Lower = GetBound(&BL.Bounds->getInitialIVValue());
+    Optional<const SCEV*> Upper = GetBound(&BL.Bounds->getFinalIVValue());
+    if (!Lower || !Upper) {
+        BL.BoundDepth = None;
+        return false;
+    }
+    if (CmpInst::isNonStrictPredicate(BL.Predicate)) {
+        // A final value available before the nest may still be an affine function of a loop around it:
+        // it is taken as an opaque value, as when the original bound is used
+        const SCEV *Final = *Upper ? *Upper : SE.getUnknown(&BL.Bounds->getFinalIVValue());
+        Upper = SE.getAddExpr(Final, SE.getOne(Final->getType()));
+    }
+    LLVM_DEBUG(dbgs() << "Loop: " << BL.L->getName() << ": bounds depend on the loop at depth " << *BL.BoundDepth << '\n');
+    BL.Predicate = CmpInst::ICMP_SLT;
+    BL.Lower = *Lower;
+    BL.Upper = *Upper;
+    return true;
+}
+
 bool LoopBlocking::checkBoundaryValuesDominance(Loop::LoopBounds &Bounds, BasicBlock *BB, DominatorTree &DT, ScalarEvolution& SE)
 {
     LLVM_DEBUG(dbgs() << "Checking upper bound:"; Bounds.getFinalIVValue().printAsOperand(dbgs()); dbgs() << '\n');
@@ -352,6 +2510,8 @@ bool LoopBlocking::checkBoundaryValuesDominance(Loop::LoopBounds &Bounds, BasicB
 
 PreservedAnalyses LoopBlockingPass::run(Function &F, FunctionAnalysisManager &AM)
 {
+    if (F.hasFnAttribute(OutlinedAttr))
+        return PreservedAnalyses::all();
     //Required analysis for this pass
     LoopInfo& LI = AM.getResult<LoopAnalysis>(F);
     DominatorTree& DT = AM.getResult<DominatorTreeAnalysis>(F);
@@ -359,8 +2519,13 @@ PreservedAnalyses LoopBlockingPass::run(Function &F, FunctionAnalysisManager &AM
     TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
     AAResults &AA = AM.getResult<AAManager>(F);
     DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
-    
-    LoopBlocking LB(LI, DT, SE, DI, AA, TTI, F);
+    AssumptionCache &AC = AM.getResult<AssumptionAnalysis>(F);
+    OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+    // The profile summary is computed by the default pipelines; in others it takes require<profile-summary>
+    ProfileSummaryInfo *PSI = AM.getResult<ModuleAnalysisManagerFunctionProxy>(F).getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+    BlockFrequencyInfo *BFI = PSI && PSI->hasProfileSummary() ? &AM.getResult<BlockFrequencyAnalysis>(F) : nullptr;
+
+    LoopBlocking LB(LI, DT, SE, DI, AA, TTI, AC, ORE, BFI, PSI, F);
     LLVM_DEBUG(dbgs() << "Starting Loop Blocking pass execution.\n");
 
     bool Changed = LB.execute();
@@ -369,13 +2534,108 @@ PreservedAnalyses LoopBlockingPass::run(Function &F, FunctionAnalysisManager &AM
         LLVM_DEBUG(dbgs() << "No change made by the pass.\n");
         return PreservedAnalyses::all();
     }
+    if (LB.hasOutlinedLoops())
+        return PreservedAnalyses::none();
+    // Loops, dominators and SCEV are kept up to date; alias analyses and dependence analysis do not cache
+    // anything about the CFG, as for the loop passes run by FunctionToLoopPassAdaptor
     PreservedAnalyses Pres;
     Pres.preserve(LoopAnalysis::ID());
     Pres.preserve(DominatorTreeAnalysis::ID());
     Pres.preserve(ScalarEvolutionAnalysis::ID());
+    Pres.preserve<AAManager>();
+    Pres.preserve<BasicAA>();
+    Pres.preserve<GlobalsAA>();
+    Pres.preserve<SCEVAA>();
+    Pres.preserve<DependenceAnalysis>();
+    Pres.preserve<OptimizationRemarkEmitterAnalysis>();
     return Pres;
 }
 
+unsigned LoopBlockingNestPass::findSlot(ArrayRef<Loop*> TopLevel, Loop *Root)
+{
+    // Searching all the top-level loops for every nest would be quadratic in the number of nests of a function
+    for (unsigned Slot : {LastSlot + 1, LastSlot - 1, LastSlot}) {
+        if (Slot < TopLevel.size() && TopLevel[Slot] == Root)
+            return LastSlot = Slot;
+    }
+    return LastSlot = find(TopLevel, Root) - TopLevel.begin();
+}
+
+PreservedAnalyses LoopBlockingNestPass::run(LoopNest &LN, LoopAnalysisManager &AM, LoopStandardAnalysisResults &AR, LPMUpdater &U)
+{
+    Loop &Root = LN.getOutermostLoop();
+    Function &F = *Root.getHeader()->getParent();
+    if (F.hasFnAttribute(OutlinedAttr))
+        return PreservedAnalyses::all();
+    // MemorySSA is not updated by the transformation
+    if (AR.MSSA) {
+        LLVM_DEBUG(dbgs() << "Loop nest pass run with MemorySSA, skipping " << Root.getName() << ".\n");
+        return PreservedAnalyses::all();
+    }
+    // Function analyses without a loop counterpart are built for the nest, as LoopInterchange does
+    DependenceInfo DI(&F, &AR.AA, &AR.SE, &AR.LI);
+    OptimizationRemarkEmitter ORE(&F);
+    // Only cached function and module analyses can be used from a loop pass: BFI comes with the loop analyses when
+    // the adaptor is asked for it
+    auto &FAMProxy = AM.getResult<FunctionAnalysisManagerLoopProxy>(Root, AR);
+    BlockFrequencyInfo *BFI = AR.BFI ? AR.BFI : FAMProxy.getCachedResult<BlockFrequencyAnalysis>(F);
+    ProfileSummaryInfo *PSI = nullptr;
+    if (auto *MAMProxy = FAMProxy.getCachedResult<ModuleAnalysisManagerFunctionProxy>(F))
+        PSI = MAMProxy->getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+
+    // The loops created by the pass are found against the loop tree before it runs: the top-level loops that replace Root
+    // at its position or are appended after the others (copies of the nest, pack loops), and the new loops inside Root
+    std::vector<Loop*> const &TopLevel = AR.LI.getTopLevelLoops();
+    size_t NumTopLevel = TopLevel.size();
+    unsigned Slot = findSlot(TopLevel, &Root);
+    SmallPtrSet<Loop*, 16> OldLoops;
+    if (ReportChildLoops)
+        for (Loop *L : Root.getLoopsInPreorder())
+            OldLoops.insert(L);
+
+    LoopBlocking LB(AR.LI, AR.DT, AR.SE, DI, AR.AA, AR.TTI, AR.AC, ORE, BFI, PSI, F);
+    LLVM_DEBUG(dbgs() << "Starting Loop Blocking pass execution on " << Root.getName() << ".\n");
+
+    if (!LB.execute(Root, Slot)) {
+        LLVM_DEBUG(dbgs() << "No change made by the pass.\n");
+        return PreservedAnalyses::all();
+    }
+#ifndef NDEBUG
+    // The blocking loops wrap the nest: they are the loops to check, not Root
+    Loop *Top = &Root;
+    while (Loop *Parent = Top->getParentLoop())
+        Top = Parent;
+    assert(Top->isRecursivelyLCSSAForm(AR.DT, AR.LI) && "Blocked nest not in LCSSA form");
+    assert(all_of(Top->getLoopsInPreorder(), [](Loop *L) { return L->isLoopSimplifyForm(); }) &&
+           "Blocked nest not in LoopSimplify form");
+#endif
+    // The new top-level loops are visited by the whole loop pipeline, with the loops inside them.
+    // They are not blocked again: the pass marks the loops it creates or blocks with llvm.loop.tile.enable = false.
+    SmallVector<Loop*, 4> NewTopLevel;
+    if (TopLevel[Slot] != &Root)
+        NewTopLevel.push_back(TopLevel[Slot]);
+    NewTopLevel.append(TopLevel.begin() + NumTopLevel, TopLevel.end());
+    // Root was a top-level loop: the parent the updater checks the new siblings against, which a release build of LLVM
+    // leaves unset
+    U.setParentLoop(nullptr);
+    if (!NewTopLevel.empty())
+        U.addSiblingLoops(NewTopLevel);
+    if (!Root.isOutermost()) {
+        // Root is inside the blocking loops and is not the root of a nest anymore: the pipeline stops on it as for
+        // a deleted loop, which also drops its cached analyses, and reaches it again from the loop that replaces it
+        U.markLoopAsDeleted(Root, Root.getName());
+    } else if (ReportChildLoops) {
+        // The children of Root with new loops inside are visited again, then Root itself
+        SmallVector<Loop*, 4> Children;
+        for (Loop *Child : Root.getSubLoops())
+            if (any_of(Child->getLoopsInPreorder(), [&](Loop *L) { return !OldLoops.count(L); }))
+                Children.push_back(Child);
+        if (!Children.empty())
+            U.addChildLoops(Children);
+    }
+    return getLoopPassPreservedAnalyses();
+}
+
 bool LoopBlocking::dominantBound(DominatorTree& DT, Value* Bound, BasicBlock* BB)
 {
     if (isa<ConstantInt>(Bound) || isa<ConstantFP>(Bound)) {
@@ -402,21 +2662,352 @@ bool LoopBlocking::dominantBound(DominatorTree& DT, Value* Bound, BasicBlock* BB
 
 Optional<BlockingInfo> LoopBlocking::blockingAnalysis(BlockingNest &BN)
 {
+    SmallVector<unsigned, MAX_NEST_SIZE> TripCounts, EstimatedTripCounts;
     for (auto it = BN.begin(); it != BN.end(); it++) {
         unsigned TripC = SE.getSmallConstantTripCount(*it);
-        LLVM_DEBUG(dbgs().indent(2) << "Trip count:" << TripC << '\n');
+        // The branch weights of the latch give the average trip count when the profile has it
+        unsigned Estimated = TripC ? TripC : getLoopEstimatedTripCount(*it).getValueOr(0);
+        LLVM_DEBUG(dbgs().indent(2) << "Trip count:" << TripC << ", estimated: " << Estimated << '\n');
+        TripCounts.push_back(TripC);
+        EstimatedTripCounts.push_back(Estimated);
     }
     std::unique_ptr<CacheCost> CacheC = std::make_unique<CacheCost>(SmallVector<Loop*, 8>(BN.begin(), BN.end()), LI, SE, TTI, AA, DI);
-    auto LoopCosts = CacheC->getLoopCosts();
-    Optional<unsigned> size = TTI.getCacheSize(TargetTransformInfo::CacheLevel::L1D);
-    Optional<unsigned> asc = TTI.getCacheAssociativity(TargetTransformInfo::CacheLevel::L1D);
     LLVM_DEBUG(dbgs() << *CacheC);
-    if (size)
-        LLVM_DEBUG(dbgs().indent(4) << *size << '\n');
-    if (asc)
-        LLVM_DEBUG(dbgs().indent(4) << *asc << '\n');
 
-    return Optional<BlockingInfo>();
+    // Loops are ranked by the cost of the nest when they are the innermost one: the most expensive goes outermost,
+    // the one with the best spatial locality innermost. Any order is legal since the nest is fully permutable.
+    SmallVector<unsigned, MAX_NEST_SIZE> Order;
+    if (ReorderLoops) {
+        for (auto &LoopCost : CacheC->getLoopCosts()) {
+            unsigned Depth = find(BN, LoopCost.first) - BN.begin();
+            if (Depth >= FirstLoopDepth && Depth < BN.size())
+                Order.push_back(Depth);
+        }
+    }
+    if (Order.size() != BN.size() - FirstLoopDepth) {
+        Order.clear();
+        for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++)
+            Order.push_back(Depth);
+    }
+    LLVM_DEBUG(dbgs() << "Loop order:"; for (unsigned Depth : Order) dbgs() << ' ' << Depth; dbgs() << '\n');
+
+    Optional<BlockingInfo> Info = computeBlockingFactors(BN, TripCounts, EstimatedTripCounts);
+    if (Info) {
+        Info->setCacheCosts(CacheC->getLoopCost(*BN[BN.size() - 1]), CacheC->getLoopCost(*BN[Order.back()]));
+        Info->setLoopOrder(std::move(Order));
+    }
+    return Info;
+}
+
+Optional<BlockingInfo> LoopBlocking::computeBlockingFactors(BlockingNest &BN, ArrayRef<unsigned> TripCounts,
+                                                           ArrayRef<unsigned> EstimatedTripCounts)
+{
+    SmallVector<ReferenceGroup, 8> Groups = collectReferenceGroups(BN);
+    SmallVector<unsigned, MAX_NEST_SIZE> Factors(BN.size(), 0);
+
+    // Factors given on the command line take precedence over the tuning database, and both over the cache model
+    if (BlockingFactor.getNumOccurrences() || !BlockingSizes.empty()) {
+        for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++) {
+            unsigned Idx = Depth - FirstLoopDepth;
+            Factors[Depth] = Idx < BlockingSizes.size() && BlockingSizes[Idx] ? BlockingSizes[Idx] : BlockingFactor;
+            LLVM_DEBUG(dbgs() << "Using blocking factor from command line for depth " << Depth << ": " << Factors[Depth] << '\n');
+        }
+    }
+    else if (Optional<SmallVector<unsigned, MAX_NEST_SIZE>> Tuned = getTunedFactors(BN)) {
+        // The tuner may have found the nest faster as it is: all factors are 0
+        Factors = std::move(*Tuned);
+    }
+    else if (Groups.empty()) {
+        LLVM_DEBUG(dbgs() << "No memory references in the nest.\n");
+    }
+    else {
+        CacheInfo Cache = getCacheInfo(0);
+        LLVM_DEBUG(dbgs().indent(4) << "L1D: " << Cache.Size << " bytes, " << Cache.Associativity << "-way, "
+                                    << Cache.LineSize << " bytes lines, " << Cache.usableSize() << " usable bytes\n");
+        // The cache model sizes the blocks with the profiled trip counts, the run time checks below still
+        // guard the trip counts unknown at compile time
+        if (Optional<SmallVector<unsigned, MAX_NEST_SIZE>> Model = selectBlockingFactors(Groups, EstimatedTripCounts, Cache))
+            Factors = std::move(*Model);
+    }
+
+    // Loop metadata overrides everything else, one loop at a time
+    for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++) {
+        TransformationMode Mode = hasTilingTransformation(BN[Depth]);
+        if (Mode & TM_Disable) {
+            Factors[Depth] = 0;
+        } else if (Mode == TM_ForcedByUser) {
+            Optional<int> Size = getOptionalIntLoopAttribute(BN[Depth], TileSizeAttr);
+            if (Size && *Size > 0)
+                Factors[Depth] = *Size;
+            else if (!Factors[Depth])
+                Factors[Depth] = BlockingFactor;
+        } else {
+            continue;
+        }
+        LLVM_DEBUG(dbgs() << "Using blocking factor from loop metadata for depth " << Depth << ": " << Factors[Depth] << '\n');
+    }
+    if (all_of(Factors, [](unsigned F) { return F == 0; }))
+        return Optional<BlockingInfo>();
+    Optional<BlockingInfo> Info = BlockingInfo(std::move(Factors));
+
+    if (TuningList) {
+        json::Array Sizes;
+        for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++)
+            Sizes.push_back(Info->getBlockingFactor(Depth));
+        errs() << json::Value(json::Object{{"id", BN.getID()}, {"loops", BN.size() - FirstLoopDepth}, {"sizes", std::move(Sizes)}}) << '\n';
+    }
+
+    if (!Groups.empty() && is_contained(TripCounts, 0u))
+        Info->setMinBlockedTripCount(minBlockedTripCount(Groups, TripCounts));
+
+    // Outer cache levels: larger blocks made of the blocks of the level below.
+    // Stop at the first level that the whole nest fits in, or that cannot hold a larger block.
+    for (unsigned Level = 1; Level < std::min(CacheLevels.getValue(), MAX_CACHE_LEVELS) && !Groups.empty(); Level++) {
+        CacheInfo Cache = getCacheInfo(Level);
+        LLVM_DEBUG(dbgs().indent(4) << 'L' << Level + 1 << "D: " << Cache.Size << " bytes, " << Cache.Associativity << "-way, "
+                                    << Cache.usableSize() << " usable bytes\n");
+        ArrayRef<unsigned> InnerFactors = Info->getBlockingFactors(Level - 1);
+        Optional<SmallVector<unsigned, MAX_NEST_SIZE>> Factors = selectBlockingFactors(Groups, EstimatedTripCounts, Cache, InnerFactors);
+        if (!Factors || ArrayRef<unsigned>(*Factors) == InnerFactors)
+            break;
+        Info->addLevel(std::move(*Factors));
+    }
+    return Info;
+}
+
+bool LoopBlocking::isColdNest(BlockingNest &BN)
+{
+    // Without a profile every nest is a candidate. Nests whose tiling is forced by loop metadata are blocked anyway.
+    if (!HotCutoff || !BFI || !PSI || !PSI->hasProfileSummary() || !ParentFunc.hasProfileData())
+        return false;
+    if (any_of(BN, [](Loop *L) { return hasTilingTransformation(L) == TM_ForcedByUser; }))
+        return false;
+    // The headers of the innermost loops run once per iteration of the whole nest: they measure its work.
+    // The innermost loop of the band may have subloops, not perfectly nested in it.
+    return none_of(BN[BN.size() - 1]->getLoopsInPreorder(), [&](Loop *L) {
+        LLVM_DEBUG(dbgs() << "Profile count of " << L->getName() << ": " << BFI->getBlockProfileCount(L->getHeader()).getValueOr(0) << '\n');
+        return PSI->isHotBlockNthPercentile(HotCutoff, L->getHeader(), BFI);
+    });
+}
+
+std::string LoopBlocking::getNestID(Loop *Top, unsigned TopSlot, unsigned Index) const
+{
+    // The location of the nest when there is debug info, otherwise the position of its top-level loop in the function
+    // and its position among the nests of that loop: both do not change with the options of the pass, so a driver
+    // can tune the nests one at a time, and are the same whether the pass runs on the function or on one loop nest
+    std::string ID;
+    raw_string_ostream OS(ID);
+    OS << ParentFunc.getName();
+    if (DebugLoc Loc = Top->getStartLoc())
+        OS << '@' << sys::path::filename(Loc->getFilename()) << ':' << Loc.getLine() << ':' << Loc.getCol();
+    else
+        OS << '#' << TopSlot << '.' << Index;
+    return OS.str();
+}
+
+Optional<SmallVector<unsigned, MAX_NEST_SIZE>> LoopBlocking::getTunedFactors(BlockingNest &BN)
+{
+    if (TuningDB.empty())
+        return None;
+    auto Entry = getTuningDB().find(BN.getID());
+    if (Entry == getTuningDB().end())
+        return None;
+    // The database lists the factors of the blocked loops, outermost first, as -blk-sizes; 0 leaves a loop unblocked
+    ArrayRef<unsigned> Sizes = Entry->second;
+    if (Sizes.size() != BN.size() - FirstLoopDepth) {
+        LLVM_DEBUG(dbgs() << "Tuning database entry of " << BN.getID() << " does not match the number of blocked loops.\n");
+        return None;
+    }
+    SmallVector<unsigned, MAX_NEST_SIZE> Factors(BN.size(), 0);
+    for (unsigned Depth = FirstLoopDepth; Depth < BN.size(); Depth++) {
+        Factors[Depth] = Sizes[Depth - FirstLoopDepth];
+        LLVM_DEBUG(dbgs() << "Using blocking factor from the tuning database for depth " << Depth << ": " << Factors[Depth] << '\n');
+    }
+    return Factors;
+}
+
+Optional<SmallVector<unsigned, MAX_NEST_SIZE>> LoopBlocking::selectBlockingFactors(ArrayRef<ReferenceGroup> Groups, ArrayRef<unsigned> TripCounts,
+                                                                                    CacheInfo const& Cache, ArrayRef<unsigned> InnerFactors)
+{
+    uint64_t Capacity = Cache.usableSize();
+    unsigned Depth = TripCounts.size();
+    // Loops outside the blocked ones run all of their iterations inside a block
+    SmallVector<uint64_t, MAX_NEST_SIZE> Extents;
+    for (unsigned TripC : TripCounts)
+        Extents.push_back(TripC ? TripC : DEFAULT_TRIP_COUNT);
+
+    // Blocking only pays off if the data touched by the whole nest does not already fit in the cache
+    if (none_of(TripCounts, [](unsigned TripC) { return TripC == 0; }) && footprint(Groups, Extents, Cache.LineSize) <= Capacity) {
+        LLVM_DEBUG(dbgs() << "Whole nest working set fits in the cache.\n");
+        return None;
+    }
+
+    auto BlockExtent = [&](unsigned D, unsigned Factor) -> uint64_t {
+        return TripCounts[D] ? std::min<uint64_t>(Factor, TripCounts[D]) : Factor;
+    };
+    // Cache lines brought in per iteration of the block: the lower, the more reuse the block captures
+    auto Traffic = [&](ArrayRef<uint64_t> E) {
+        double Iterations = 1;
+        for (unsigned D = FirstLoopDepth; D < Depth; D++)
+            Iterations *= E[D];
+        return footprint(Groups, E, Cache.LineSize) / Iterations;
+    };
+    // How many groups walk contiguous memory along a loop: it breaks ties in favour of longer blocks along it
+    auto Contiguity = [&](unsigned D) {
+        return count_if(Groups, [&](ReferenceGroup const& G) {
+            return G.Strides[D] && *G.Strides[D] > 0 && *G.Strides[D] < Cache.LineSize;
+        });
+    };
+
+    // Start from the smallest blocks (the blocks of the cache level below, if any) and keep doubling the factor
+    // of the loop that reduces the traffic the most, as long as the working set of a block fits in the cache.
+    // Doubling keeps the factors multiples of the ones they started from.
+    SmallVector<unsigned, MAX_NEST_SIZE> Factors(Depth, 0);
+    for (unsigned D = FirstLoopDepth; D < Depth; D++) {
+        Factors[D] = InnerFactors.empty() ? MIN_BLOCKING_FACTOR : InnerFactors[D];
+        Extents[D] = BlockExtent(D, Factors[D]);
+    }
+    if (footprint(Groups, Extents, Cache.LineSize) > Capacity) {
+        LLVM_DEBUG(dbgs() << "Even the smallest blocks do not fit in the cache.\n");
+        return None;
+    }
+    while (true) {
+        Optional<unsigned> Best;
+        double BestTraffic = Traffic(Extents);
+        for (unsigned D = FirstLoopDepth; D < Depth; D++) {
+            // Blocks of an outer level can grow up to MAX_BLOCKING_FACTOR inner blocks
+            unsigned MaxFactor = InnerFactors.empty() ? MAX_BLOCKING_FACTOR : MAX_BLOCKING_FACTOR * InnerFactors[D];
+            if (!Factors[D] || Factors[D] * 2 > MaxFactor || (TripCounts[D] && Factors[D] >= TripCounts[D]))
+                continue;
+            SmallVector<uint64_t, MAX_NEST_SIZE> Candidate(Extents);
+            Candidate[D] = BlockExtent(D, Factors[D] * 2);
+            if (footprint(Groups, Candidate, Cache.LineSize) > Capacity)
+                continue;
+            double CandidateTraffic = Traffic(Candidate);
+            if (!Best || CandidateTraffic < BestTraffic ||
+                (CandidateTraffic == BestTraffic && Contiguity(D) >= Contiguity(*Best))) {
+                Best = D;
+                BestTraffic = CandidateTraffic;
+            }
+        }
+        if (!Best)
+            break;
+        Factors[*Best] *= 2;
+        Extents[*Best] = BlockExtent(*Best, Factors[*Best]);
+    }
+    LLVM_DEBUG(dbgs().indent(4) << "Blocking factors:"; for (unsigned F : Factors) dbgs() << ' ' << F;
+               dbgs() << " (" << footprint(Groups, Extents, Cache.LineSize) << " bytes)\n");
+    return Factors;
+}
+
+unsigned LoopBlocking::minBlockedTripCount(ArrayRef<ReferenceGroup> Groups, ArrayRef<unsigned> TripCounts)
+{
+    // Smallest value of the trip counts unknown at compile time for which the nest does not fit in the L1D.
+    // The working set grows with each trip count: if all the unknown ones are below it, blocking is useless.
+    CacheInfo Cache = getCacheInfo(0);
+    auto Fits = [&](uint64_t TripC) {
+        SmallVector<uint64_t, MAX_NEST_SIZE> Extents;
+        for (unsigned KnownTripC : TripCounts)
+            Extents.push_back(KnownTripC ? KnownTripC : TripC);
+        return footprint(Groups, Extents, Cache.LineSize) <= Cache.usableSize();
+    };
+    uint64_t Low = 1, High = std::numeric_limits<uint32_t>::max();
+    if (!Fits(Low) || Fits(High))
+        return 0;
+    while (High - Low > 1) {
+        uint64_t Mid = Low + (High - Low) / 2;
+        (Fits(Mid) ? Low : High) = Mid;
+    }
+    LLVM_DEBUG(dbgs().indent(4) << "Unknown trip counts must reach " << High << " for blocking to pay off\n");
+    return High;
+}
+
+SmallVector<ReferenceGroup, 8> LoopBlocking::collectReferenceGroups(BlockingNest &BN)
+{
+    const DataLayout &DL = ParentFunc.getParent()->getDataLayout();
+    SmallVector<ReferenceGroup, 8> Groups;
+    for (BasicBlock *BB : BN.topLoop()->blocks()) {
+        for (Instruction &I : *BB) {
+            Value *Ptr = getLoadStorePointerOperand(&I);
+            if (!Ptr)
+                continue;
+            const SCEV *PtrSCEV = SE.getSCEV(Ptr);
+            unsigned ElementSize = DL.getTypeStoreSize(getLoadStoreType(&I));
+            // Peel the recurrences of the nest loops, innermost first, to get the stride along each of them
+            SmallVector<Optional<int64_t>, MAX_NEST_SIZE> Strides(BN.size(), 0);
+            const SCEV *Cur = PtrSCEV;
+            while (auto *AR = dyn_cast<SCEVAddRecExpr>(Cur)) {
+                auto LoopIt = find(BN, AR->getLoop());
+                if (LoopIt == BN.end())
+                    break;
+                Optional<int64_t> Stride;
+                if (auto *C = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE)))
+                    Stride = C->getAPInt().abs().getLimitedValue();
+                Strides[LoopIt - BN.begin()] = Stride;
+                Cur = AR->getStart();
+            }
+            // An address that varies with the nest in any other way is as bad as a non constant stride
+            for (unsigned Depth = 0; Depth < BN.size(); Depth++)
+                if (!SE.isLoopInvariant(Cur, BN[Depth]))
+                    Strides[Depth] = None;
+            const SCEV *Base = SE.getPointerBase(PtrSCEV);
+
+            auto GroupIt = find_if(Groups, [&](ReferenceGroup &G) { return G.Base == Base && G.Strides == Strides; });
+            if (GroupIt != Groups.end()) {
+                GroupIt->ElementSize = std::max(GroupIt->ElementSize, ElementSize);
+                continue;
+            }
+            LLVM_DEBUG(dbgs().indent(4) << "New reference group: "; I.print(dbgs()); dbgs() << '\n');
+            Groups.emplace_back(Base, ElementSize, std::move(Strides));
+        }
+    }
+    return Groups;
+}
+
+uint64_t LoopBlocking::footprint(ArrayRef<ReferenceGroup> Groups, ArrayRef<uint64_t> Extents, unsigned LineSize)
+{
+    // Bytes brought into the cache by the iterations of a block spanning Extents[D] iterations of the D-th loop.
+    // The loop with the smallest sub-line stride walks consecutive elements in the same lines,
+    // every other loop the reference depends on touches a new set of lines at each iteration.
+    uint64_t Total = 0;
+    for (const ReferenceGroup &G : Groups) {
+        Optional<unsigned> Contiguous;
+        for (unsigned D = 0; D < G.Strides.size(); D++) {
+            Optional<int64_t> Stride = G.Strides[D];
+            if (Stride && *Stride > 0 && *Stride < LineSize && (!Contiguous || *Stride < *G.Strides[*Contiguous]))
+                Contiguous = D;
+        }
+        uint64_t Bytes = Contiguous ? alignTo(Extents[*Contiguous] * std::max<int64_t>(*G.Strides[*Contiguous], G.ElementSize), LineSize)
+                                    : LineSize;
+        for (unsigned D = 0; D < G.Strides.size(); D++)
+            if ((!Contiguous || D != *Contiguous) && G.Strides[D] != Optional<int64_t>(0))
+                Bytes = SaturatingMultiply(Bytes, Extents[D]);
+        Total = SaturatingAdd(Total, Bytes);
+    }
+    return Total;
+}
+
+CacheInfo LoopBlocking::getCacheInfo(unsigned Level)
+{
+    // Sizes given on the command line come first, then what the target reports, then the compile-time defaults.
+    // TargetTransformInfo does not describe caches beyond L2.
+    static const unsigned DefaultSizes[MAX_CACHE_LEVELS] = {L1_DCACHE_SIZE, L2_DCACHE_SIZE, L3_DCACHE_SIZE};
+    static const unsigned DefaultAssoc[MAX_CACHE_LEVELS] = {L1_DCACHE_ASSOC, L2_DCACHE_ASSOC, L3_DCACHE_ASSOC};
+    assert(Level < MAX_CACHE_LEVELS && "Cache level not modeled");
+    Optional<unsigned> TargetSize, TargetAssoc;
+    if (Level < 2) {
+        auto TTILevel = Level == 0 ? TargetTransformInfo::CacheLevel::L1D : TargetTransformInfo::CacheLevel::L2D;
+        TargetSize = TTI.getCacheSize(TTILevel);
+        TargetAssoc = TTI.getCacheAssociativity(TTILevel);
+    }
+    CacheInfo Cache;
+    if (Level < CacheSizes.size() && CacheSizes[Level])
+        Cache.Size = CacheSizes[Level];
+    else
+        Cache.Size = TargetSize.getValueOr(DefaultSizes[Level]);
+    Cache.Associativity = TargetAssoc.getValueOr(DefaultAssoc[Level]);
+    Cache.LineSize = TTI.getCacheLineSize() ? TTI.getCacheLineSize() : L1_DCACHE_LINESIZE;
+    return Cache;
 }
 
 extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -437,6 +3028,34 @@ extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo() {
                         return false;
                     }
                 );
+                // Inside loop(...), e.g. -passes='loop(custom-loopblocking)'
+                PB.registerPipelineParsingCallback(
+                    [](StringRef  name, LoopPassManager& passManager, ArrayRef<PassBuilder::PipelineElement>) -> bool {
+                        if (name == "custom-loopblocking")
+                        {
+                            // Loop passes added after this one are not known yet
+                            passManager.addPass(LoopBlockingNestPass(passManager.getNumLoopPasses() > 0));
+                            return true;
+                        }
+
+                        return false;
+                    }
+                );
+                // Default pipelines, e.g. clang -O3 -fpass-plugin=LoopBlocking.so: the position is read when the
+                // pipeline is built, after the command line has been parsed
+                PB.registerLoopOptimizerEndEPCallback(
+                    [](LoopPassManager& passManager, OptimizationLevel Level) {
+                        if (Position == BlockingPosition::LoopOptimizerEnd && isBlockingLevel(Level))
+                            passManager.addPass(LoopBlockingNestPass(passManager.getNumLoopPasses() > 0));
+                    }
+                );
+                PB.registerVectorizerStartEPCallback(
+                    [](FunctionPassManager& passManager, OptimizationLevel Level) {
+                        if (Position == BlockingPosition::VectorizerStart && isBlockingLevel(Level))
+                            passManager.addPass(createFunctionToLoopPassAdaptor(LoopBlockingNestPass(), /*UseMemorySSA=*/false,
+                                                                                /*UseBlockFrequencyInfo=*/true));
+                    }
+                );
             }
     };
-}
\ No newline at end of file
+}
@@ -3,17 +3,66 @@
 
 #include <llvm/ADT/STLExtras.h>
 #ifndef L1_DCACHE_LINESIZE
-#define L1_CACHE_LINESIZE 64
+#define L1_DCACHE_LINESIZE 64
 #endif
 
 #ifndef L1_DCACHE_SIZE
 #define L1_DCACHE_SIZE 65536
 #endif
 
+#ifndef L1_DCACHE_ASSOC
+#define L1_DCACHE_ASSOC 8
+#endif
+
+// Outer cache levels, used when blocking for more than one level
+#ifndef L2_DCACHE_SIZE
+#define L2_DCACHE_SIZE 1048576
+#endif
+
+#ifndef L2_DCACHE_ASSOC
+#define L2_DCACHE_ASSOC 16
+#endif
+
+#ifndef L3_DCACHE_SIZE
+#define L3_DCACHE_SIZE 8388608
+#endif
+
+#ifndef L3_DCACHE_ASSOC
+#define L3_DCACHE_ASSOC 16
+#endif
+
+#ifndef MAX_CACHE_LEVELS
+#define MAX_CACHE_LEVELS 3u
+#endif
+
+// Range of blocking factors the cache model is allowed to choose from
+#ifndef MIN_BLOCKING_FACTOR
+#define MIN_BLOCKING_FACTOR 4u
+#endif
+
+#ifndef MAX_BLOCKING_FACTOR
+#define MAX_BLOCKING_FACTOR 1024u
+#endif
+
+// Trip count assumed by the cache model when SCEV cannot compute it
+#ifndef DEFAULT_TRIP_COUNT
+#define DEFAULT_TRIP_COUNT 100u
+#endif
+
+// Largest unroll-and-jam factor for the loops inside a full block
+#ifndef MAX_UNROLL_AND_JAM_FACTOR
+#define MAX_UNROLL_AND_JAM_FACTOR 8u
+#endif
+
 #ifndef MAX_NEST_SIZE
 #define MAX_NEST_SIZE 3u
 #endif
 
+// Largest stack buffer the blocks of the packed arrays of a nest are copied to, in bytes
+#ifndef MAX_PACK_SIZE
+#define MAX_PACK_SIZE 262144u
+#endif
+
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/ScalarEvolution.h>
@@ -29,6 +78,13 @@
 #include <optional>
 #include <llvm/Analysis/LoopNestAnalysis.h>
 #include <llvm/Analysis/DependenceAnalysis.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/LoopCacheAnalysis.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
 
 namespace llvm {
 
@@ -37,12 +93,145 @@ public:
     PreservedAnalyses run(Function& F, FunctionAnalysisManager& AM);
 };
 
+// Same transformation on one loop nest at a time, for the loop pipelines of PassBuilder: LoopSimplify and LCSSA forms
+// are kept, loops are not outlined for -blk-parallel.
+// ReportChildLoops is set when the loop pass manager also has loop passes, so it visits every loop and not only the nests:
+// the loops created inside the nest are then added to its worklist, which a manager of loop nest passes only does not allow.
+class LoopBlockingNestPass : public llvm::PassInfoMixin<LoopBlockingNestPass> {
+public:
+    LoopBlockingNestPass(bool ReportChildLoops = false) : ReportChildLoops(ReportChildLoops) {}
+    PreservedAnalyses run(LoopNest& LN, LoopAnalysisManager& AM, LoopStandardAnalysisResults& AR, LPMUpdater& U);
+private:
+    bool ReportChildLoops;
+    // Position of the last nest among the top-level loops of its function: the loop pass manager visits them in order,
+    // so the next one is looked for next to it first
+    unsigned LastSlot = 0;
+    unsigned findSlot(ArrayRef<Loop*> TopLevel, Loop *Root);
+};
+
+// Blocking factor of each loop of a BlockingNest, indexed by depth in the nest (outermost first).
+// Loops that are not blocked have factor 0.
+// There is a set of factors for each cache level, starting from L1: the factors of a level are multiples of
+// the ones of the level below, so the blocks of a level are made of whole blocks of the level below.
+// The order of the blocked loops, outermost first, is used both for the blocking loops and the loops inside a block.
 struct BlockingInfo
 {
-    BlockingInfo(unsigned int Factor) : BlockingFactor(Factor) {}
-    unsigned int getBlockingFactor() const { return BlockingFactor; }
+    BlockingInfo(SmallVectorImpl<unsigned> &&Factors) { Levels.emplace_back(std::move(Factors)); }
+    unsigned int getBlockingFactor(unsigned Depth, unsigned Level = 0) const { return Levels[Level][Depth]; }
+    ArrayRef<unsigned> getBlockingFactors(unsigned Level = 0) const { return Levels[Level]; }
+    unsigned getNumLevels() const { return Levels.size(); }
+    void addLevel(SmallVectorImpl<unsigned> &&Factors) { Levels.emplace_back(std::move(Factors)); }
+    ArrayRef<unsigned> getLoopOrder() const { return LoopOrder; }
+    void setLoopOrder(SmallVectorImpl<unsigned> &&Order) { LoopOrder = std::move(Order); }
+    // Depth of the loop whose blocking loop ends up outermost, before they are created: the first one in the loop order
+    // with a blocking loop at the highest level that has one (a factor equal to the one below makes none)
+    Optional<unsigned> getOutermostBlockedLoop() const
+    {
+        for (unsigned Level = Levels.size(); Level-- > 0;) {
+            for (unsigned Depth : LoopOrder) {
+                unsigned Below = 0;
+                for (unsigned L = 0; L < Level; L++)
+                    Below = Levels[L][Depth] ? Levels[L][Depth] : Below;
+                if (Levels[Level][Depth] && Levels[Level][Depth] != Below)
+                    return Depth;
+            }
+        }
+        return None;
+    }
+    // Smallest trip count, for the loops whose trip count is unknown at compile time, that makes blocking pay off (0 if none)
+    unsigned getMinBlockedTripCount() const { return MinBlockedTripCount; }
+    void setMinBlockedTripCount(unsigned TripC) { MinBlockedTripCount = TripC; }
+    // CacheCost of the nest with its original innermost loop, and with the innermost loop of the chosen order
+    CacheCostTy getOriginalCost() const { return OriginalCost; }
+    CacheCostTy getBlockedCost() const { return BlockedCost; }
+    void setCacheCosts(CacheCostTy Original, CacheCostTy Blocked) { OriginalCost = Original; BlockedCost = Blocked; }
 private:
-    unsigned int BlockingFactor;
+    SmallVector<SmallVector<unsigned, MAX_NEST_SIZE>, MAX_CACHE_LEVELS> Levels;
+    SmallVector<unsigned, MAX_NEST_SIZE> LoopOrder;
+    unsigned MinBlockedTripCount = 0;
+    CacheCostTy OriginalCost = CacheCost::InvalidCost;
+    CacheCostTy BlockedCost = CacheCost::InvalidCost;
+};
+
+// Blocking loop created for a cache level
+struct BlockingLevel
+{
+    unsigned Factor;
+    Loop *BlockingLoop;
+    // First iteration of the current block and (exclusive or inclusive, following the predicate) end of it
+    PHINode *BlockIV;
+    Value *BlockEnd;
+    // End of the block when it is not cut by the loop bound
+    Value *FullBlockEnd;
+    // Test in the blocking loop header: the end of the block of the level above replaces its bound
+    CmpInst *ExitCond;
+};
+
+// A loop of the nest selected for blocking. After the transformation the loop iterates inside a block,
+// whose boundaries are given by the blocking loops created for it, one for each cache level (innermost first).
+struct BlockedLoop
+{
+    BlockedLoop(Loop *L, unsigned Depth, Loop::LoopBounds &&Bounds, CmpInst::Predicate Pred) :
+        L(L), Depth(Depth), Bounds(std::make_unique<Loop::LoopBounds>(std::move(Bounds))), Predicate(Pred) {}
+    Loop *L;
+    unsigned Depth;
+    std::unique_ptr<Loop::LoopBounds> Bounds;
+    // Predicate that holds while the IV is inside the bounds: strict or non-strict, signed or unsigned
+    CmpInst::Predicate Predicate;
+    // Looked up before the blocking loops are created
+    PHINode *IV = nullptr;
+    SmallVector<BlockingLevel, MAX_CACHE_LEVELS> Levels;
+    // Skewing factor with respect to the outermost loop of the band: blocks are taken along IV + Skew * IV0
+    int64_t Skew = 0;
+    // Bounds of a non-rectangular loop: SCEVs affine in the IV of the loop of the band at depth BoundDepth,
+    // or null for an original bound available before the nest. Upper is exclusive, as the predicate is then SLT
+    const SCEV *Lower = nullptr;
+    const SCEV *Upper = nullptr;
+    Optional<unsigned> BoundDepth;
+    // Trip count before blocking, constant or from the profile
+    Optional<unsigned> EstimatedTripCount;
+};
+
+// An array whose block is copied to a contiguous buffer while the loops inside the block run on it.
+// All the accesses of the nest to the array have the same address, affine in the loops of the band.
+struct PackedArray
+{
+    const SCEV *Ptr;
+    // Address at the first iteration of the loops of the band, invariant in them
+    const SCEV *Start;
+    Type *ElementType;
+    Align Alignment;
+    SmallVector<Instruction*, 4> Accesses;
+    // Positions in the band of the loops the address depends on, and bytes between two of their iterations:
+    // the first one is the slowest in the buffer, the last one the fastest
+    SmallVector<unsigned, MAX_NEST_SIZE> Dims;
+    SmallVector<const SCEV*, MAX_NEST_SIZE> Steps;
+    // The block is read before the loops inside it, unless it is only written there, and written back after them if written
+    bool CopyIn = false;
+    bool CopyOut = false;
+};
+
+// Parameters of the data cache the blocking factor is computed for
+struct CacheInfo
+{
+    unsigned Size;
+    unsigned Associativity;
+    unsigned LineSize;
+    // One way of the cache is left for conflict misses and for data that is not part of the block
+    unsigned usableSize() const { return Associativity > 1 ? Size / Associativity * (Associativity - 1) : Size / 2; }
+};
+
+// Memory references to the same array with the same strides along the loops of a nest:
+// inside a block they touch the same cache lines, so the cost model counts them once.
+struct ReferenceGroup
+{
+    ReferenceGroup(const SCEV *Base, unsigned ElementSize, SmallVectorImpl<Optional<int64_t>> &&Strides) :
+        Base(Base), ElementSize(ElementSize), Strides(std::move(Strides)) {}
+    const SCEV *Base;
+    unsigned ElementSize;
+    // Stride in bytes along each loop of the nest (outermost first):
+    // 0 if the reference does not depend on the loop, None if the stride is not a constant.
+    SmallVector<Optional<int64_t>, MAX_NEST_SIZE> Strides;
 };
 
 class BlockingNest
@@ -59,20 +248,38 @@ public:
     NestIter end()      { return Nest.end(); }
     unsigned size() const    { return Nest.size(); }
     SmallVector<Loop*> innerLoops() { return SmallVector<Loop*>(Nest.begin() + 1, Nest.end()); }
+    Loop *operator[](unsigned Idx) const { return Nest[Idx]; }
 
     bool areAllLoopsSimplified() { return all_of(Nest, [](Loop* L) { return L->isLoopSimplifyForm(); }); }
     bool areAllLoopsRotated() { return all_of(Nest, [](Loop* L) { return L->isRotatedForm(); }); }
+
+    StringRef getID() const { return ID; }
+    void setID(std::string NewID) { ID = std::move(NewID); }
+    // Position of the top loop among the subloops of its parent, or among the top-level loops
+    unsigned getSlot() const { return Slot; }
+    void setSlot(unsigned NewSlot) { Slot = NewSlot; }
 private:
     SmallVector<Loop*, 8> Nest;
+    std::string ID;
+    unsigned Slot = 0;
 };
 
+// Memory accesses whose dependence can only be decided at run time
+using AccessPair = std::pair<Instruction*, Instruction*>;
+
 class LoopBlocking {
 public:
     LoopBlocking(
         LoopInfo& LI, DominatorTree& DT, ScalarEvolution& SE, 
-        DependenceInfo &DI, AAResults &AA, TargetTransformInfo &TTI, Function &F): 
-        LI(LI), DT(DT), SE(SE), DI(DI), AA(AA), TTI(TTI), ParentFunc(F) {}
+        DependenceInfo &DI, AAResults &AA, TargetTransformInfo &TTI, AssumptionCache &AC,
+        OptimizationRemarkEmitter &ORE, BlockFrequencyInfo *BFI, ProfileSummaryInfo *PSI, Function &F): 
+        LI(LI), DT(DT), SE(SE), DI(DI), AA(AA), TTI(TTI), AC(AC), ORE(ORE), BFI(BFI), PSI(PSI), ParentFunc(F) {}
     bool execute();
+    // Blocks the nests inside a top-level loop, for the loop nest pass: no loop is outlined.
+    // Slot is the position of Root among the top-level loops.
+    bool execute(Loop &Root, unsigned Slot);
+    // Outlining moves code to new functions and does not keep the analyses up to date
+    bool hasOutlinedLoops() const { return OutlinedLoops; }
 private:
     LoopInfo& LI;
     DominatorTree& DT;
@@ -80,16 +287,85 @@ private:
     DependenceInfo &DI;
     AAResults &AA;
     TargetTransformInfo &TTI;
-    SmallVector<DominatorTree::UpdateType, 8> DomTreeUpdateVect;
+    AssumptionCache &AC;
+    OptimizationRemarkEmitter &ORE;
+    // Only with profile data, to leave cold nests alone
+    BlockFrequencyInfo *BFI;
+    ProfileSummaryInfo *PSI;
+    // Outermost blocking loops whose iterations are independent, outlined once all the nests are transformed
+    SmallVector<BlockingLevel, 4> ParallelLoops;
+    // Only when all the nests of the function are transformed: the loop nest pass leaves the blocking loops sequential
+    bool OutlineParallel = false;
+    bool OutlinedLoops = false;
+    // Set by the changes made to a nest before it is rejected, e.g. hoisted bounds
+    bool Modified = false;
+    // Empty blocks that keep the exits of the nests at their depth in the dominator tree, with the name of the exit
+    // they lead to moved to the first one: only when all the nests of the function are transformed, see setExitDominator
+    bool PadExits = false;
+    SmallVector<std::pair<BasicBlock*, BasicBlock*>, 8> ExitPads;
+    SmallVector<BasicBlock*, 32> PadBlocks;
 
     Function& ParentFunc;
     
     bool dominantBound(DominatorTree& DT, Value* Bound, BasicBlock* BB);
+    bool collectMemoryInstructions(BlockingNest &BN, SmallVectorImpl<Instruction*> &MemInsts);
+    bool checkDependences(BlockingNest &BN, SmallVectorImpl<bool> &Carried, SmallVectorImpl<AccessPair> &AliasChecks);
+    bool computeSkewFactors(BlockingNest &BN, MutableArrayRef<BlockedLoop> Band);
+    void skewBlocks(MutableArrayRef<BlockedLoop> Band);
+    bool getAffineBounds(MutableArrayRef<BlockedLoop> Band, Loop *Top);
+    void boundNonRectangularBlocks(MutableArrayRef<BlockedLoop> Band);
+    void guardBlockedLoop(BlockedLoop &BL, Value *Start, Value *End);
+    BlockingLevel createWavefront(MutableArrayRef<BlockedLoop> Band);
+    bool hasValuesLiveOut(BlockingNest &BN);
     bool checkBoundaryValuesDominance(Loop::LoopBounds &Bounds, BasicBlock *BB, DominatorTree &DT, ScalarEvolution& SE);
     bool transform(BlockingNest& C);
-    SmallVector<BlockingNest> collectCandidates(ArrayRef<Loop*> const& loopsVector);
+    bool transformNests(MutableArrayRef<BlockingNest> Nests);
+    // Optimization remarks: why a nest was not blocked (Name is the reason, as in -pass-remarks-output), and how it was
+    void remarkMissed(BlockingNest &BN, StringRef Name, StringRef Msg);
+    void remarkMissed(Loop *L, StringRef Name, StringRef Msg);
+    void remarkBlocked(BlockingNest &BN, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info, unsigned NumLevels,
+                       bool Skewed, bool Versioned, unsigned NumPacked, unsigned NumPrefetches);
+    bool prepareNest(Loop *L);
+    // Loops are the top-level loops of the function from position FirstSlot on
+    SmallVector<BlockingNest> collectCandidates(ArrayRef<Loop*> Loops, unsigned FirstSlot = 0);
+    void collectPerfectNests(Loop *L, unsigned Slot, SmallVectorImpl<BlockingNest> &Nests);
     Optional<BlockingInfo> blockingAnalysis(BlockingNest &L);
-    Loop* createBlockingLoop(Loop *Target, Loop *Outer, Loop::LoopBounds const& TargetBounds, BlockingInfo &Info);
+    // TripCounts are known at compile time (0 if not), EstimatedTripCounts also come from the profile
+    Optional<BlockingInfo> computeBlockingFactors(BlockingNest &BN, ArrayRef<unsigned> TripCounts, ArrayRef<unsigned> EstimatedTripCounts);
+    bool isColdNest(BlockingNest &BN);
+    // Stable name of a nest, used as key in the tuning database
+    std::string getNestID(Loop *Top, unsigned TopSlot, unsigned Index) const;
+    Optional<SmallVector<unsigned, MAX_NEST_SIZE>> getTunedFactors(BlockingNest &BN);
+    SmallVector<ReferenceGroup, 8> collectReferenceGroups(BlockingNest &BN);
+    unsigned minBlockedTripCount(ArrayRef<ReferenceGroup> Groups, ArrayRef<unsigned> TripCounts);
+    uint64_t footprint(ArrayRef<ReferenceGroup> Groups, ArrayRef<uint64_t> Extents, unsigned LineSize);
+    Optional<SmallVector<unsigned, MAX_NEST_SIZE>> selectBlockingFactors(ArrayRef<ReferenceGroup> Groups, ArrayRef<unsigned> TripCounts, CacheInfo const& Cache,
+                                                                          ArrayRef<unsigned> InnerFactors = None);
+    CacheInfo getCacheInfo(unsigned Level = 0);
+    Optional<CmpInst::Predicate> getBlockingPredicate(Loop::LoopBounds const& Bounds, Loop *Top);
+    Loop* createBlockingLoop(BlockedLoop &Target, Loop *Outer, unsigned Factor);
+    void insertBlockingLoop(Loop *BlockingLoop, Loop *Inner, unsigned Slot);
+    void updateDominatorTree(Loop *Blocking, Loop *Nest);
+    void setExitDominator(BasicBlock *Exit, BasicBlock *IDom);
+    void removeExitPads();
+    void formDedicatedExit(Loop *L);
+    bool permuteLoops(ArrayRef<BlockedLoop> Band, ArrayRef<unsigned> Order);
+    Optional<std::pair<const SCEV*, const SCEV*>> getAccessRange(Instruction *I, Loop *Top);
+    // Loop IDs and estimated trip counts of the blocking loops and of the loops inside the blocks
+    void annotateBlockedLoops(ArrayRef<BlockedLoop> Band, ArrayRef<unsigned> Order);
+    bool versionNest(BlockingNest &BN, BlockingInfo const& Info, ArrayRef<AccessPair> AliasChecks);
+    SmallVector<PackedArray, 4> selectPackedArrays(BlockingNest &BN, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info,
+                                                   ArrayRef<AccessPair> AliasChecks, bool Versioned);
+    bool hasCacheConflicts(PackedArray const& PA, ArrayRef<BlockedLoop> Band, BlockingInfo const& Info);
+    void packArray(PackedArray const& PA, ArrayRef<BlockedLoop> Band, Loop *Nest);
+    void createCopyLoops(PackedArray const& PA, Instruction *InsertPt, Value *Array, Value *Buffer, ArrayRef<Value*> Steps,
+                         ArrayRef<uint64_t> BufferStrides, ArrayRef<Value*> Counts, ArrayRef<unsigned> Factors, bool ToBuffer);
+    Loop *versionFullTiles(ArrayRef<BlockedLoop> Band, Loop *Nest);
+    unsigned insertPrefetches(ArrayRef<BlockedLoop> Band, Loop *Nest);
+    unsigned getUnrollAndJamFactor(Loop *Outer);
+    bool canUnrollAndJam(Loop *Outer);
+    bool unrollAndJamBlock(Loop *Nest);
+    bool outlineParallelLoop(BlockingLevel const& Parallel);
 };
 
 }
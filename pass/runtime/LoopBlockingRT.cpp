@@ -0,0 +1,217 @@
+#include "LoopBlockingRT.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef LB_RUNTIME_OPENMP
+
+// OpenMP backend: the compiler lowers the parallel loop to the OpenMP runtime (__kmpc_fork_call with libomp)
+extern "C" void lb_parallel_for(int64_t Lower, int64_t Upper, int64_t Step, lb_body_fn Body, void *Ctx)
+{
+    if (Upper <= Lower)
+        return;
+    int64_t Iterations = (Upper - Lower - 1) / Step + 1;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int64_t I = 0; I < Iterations; I++)
+        Body(Lower + I * Step, Ctx);
+}
+
+#else
+
+namespace {
+
+// Set while running a body: nested parallel loops run serially on the current thread
+thread_local bool InParallelLoop = false;
+
+// Work-stealing pool. A parallel loop is split into one contiguous range of iterations per thread:
+// each thread runs its range from the front, and when it is empty steals the back half of the largest other range.
+// Iterations are whole blocks, so a mutex per range is cheap compared to the work it protects.
+class ThreadPool
+{
+public:
+    static ThreadPool &get()
+    {
+        static ThreadPool Pool;
+        return Pool;
+    }
+
+    unsigned size() const { return Ranges.size(); }
+
+    void run(int64_t Lower, int64_t Step, int64_t Iterations, lb_body_fn Body, void *Ctx)
+    {
+        // One loop at a time: a loop started while another is running (e.g. from another application thread)
+        // waits for it to complete
+        std::lock_guard<std::mutex> RunLock(RunMutex);
+        Job = {Lower, Step, Body, Ctx};
+        // Set before the ranges: a thread still stealing from the previous loop may pick up iterations right away
+        Pending.store(Iterations);
+        int64_t Chunk = Iterations / size(), Extra = Iterations % size(), Begin = 0;
+        for (unsigned T = 0; T < size(); T++) {
+            int64_t End = Begin + Chunk + (T < Extra);
+            std::lock_guard<std::mutex> Lock(Ranges[T].Mutex);
+            Ranges[T].Begin = Begin;
+            Ranges[T].End = End;
+            Begin = End;
+        }
+        {
+            std::lock_guard<std::mutex> Lock(StateMutex);
+            Generation++;
+        }
+        Wake.notify_all();
+        // The calling thread is worker 0
+        work(0);
+        std::unique_lock<std::mutex> Lock(StateMutex);
+        Done.wait(Lock, [this] { return Pending.load() == 0; });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> Lock(StateMutex);
+            Stop = true;
+        }
+        Wake.notify_all();
+        for (std::thread &T : Threads)
+            T.join();
+    }
+
+private:
+    struct Range
+    {
+        std::mutex Mutex;
+        int64_t Begin = 0;
+        int64_t End = 0;
+    };
+    struct LoopJob
+    {
+        int64_t Lower;
+        int64_t Step;
+        lb_body_fn Body;
+        void *Ctx;
+    };
+
+    std::vector<Range> Ranges;
+    std::vector<std::thread> Threads;
+    std::mutex RunMutex;
+    std::mutex StateMutex;
+    std::condition_variable Wake;
+    std::condition_variable Done;
+    uint64_t Generation = 0;
+    bool Stop = false;
+    LoopJob Job;
+    std::atomic<int64_t> Pending{0};
+
+    ThreadPool() : Ranges(numThreads())
+    {
+        for (unsigned T = 1; T < size(); T++)
+            Threads.emplace_back([this, T] { loop(T); });
+    }
+
+    static unsigned numThreads()
+    {
+        if (const char *Env = std::getenv("LB_NUM_THREADS"))
+            if (int N = std::atoi(Env); N > 0)
+                return N;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    void loop(unsigned Self)
+    {
+        // Pool threads only run bodies
+        InParallelLoop = true;
+        uint64_t Seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> Lock(StateMutex);
+                Wake.wait(Lock, [&] { return Stop || Generation != Seen; });
+                if (Stop)
+                    return;
+                Seen = Generation;
+            }
+            work(Self);
+        }
+    }
+
+    bool popFront(unsigned T, int64_t &Iteration)
+    {
+        std::lock_guard<std::mutex> Lock(Ranges[T].Mutex);
+        if (Ranges[T].Begin == Ranges[T].End)
+            return false;
+        Iteration = Ranges[T].Begin++;
+        return true;
+    }
+
+    bool steal(unsigned Self)
+    {
+        // Victim: the thread with the most iterations left
+        unsigned Victim = Self;
+        int64_t Largest = 0;
+        for (unsigned T = 0; T < size(); T++) {
+            if (T == Self)
+                continue;
+            std::lock_guard<std::mutex> Lock(Ranges[T].Mutex);
+            if (Ranges[T].End - Ranges[T].Begin > Largest) {
+                Largest = Ranges[T].End - Ranges[T].Begin;
+                Victim = T;
+            }
+        }
+        if (Victim == Self)
+            return false;
+        int64_t Begin, End;
+        {
+            std::lock_guard<std::mutex> Lock(Ranges[Victim].Mutex);
+            int64_t Left = Ranges[Victim].End - Ranges[Victim].Begin;
+            if (Left == 0)
+                return true;
+            End = Ranges[Victim].End;
+            Begin = End - (Left + 1) / 2;
+            Ranges[Victim].End = Begin;
+        }
+        std::lock_guard<std::mutex> Lock(Ranges[Self].Mutex);
+        Ranges[Self].Begin = Begin;
+        Ranges[Self].End = End;
+        return true;
+    }
+
+    void work(unsigned Self)
+    {
+        int64_t Iteration;
+        do {
+            while (popFront(Self, Iteration)) {
+                Job.Body(Job.Lower + Iteration * Job.Step, Job.Ctx);
+                if (Pending.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> Lock(StateMutex);
+                    Done.notify_all();
+                }
+            }
+        } while (steal(Self));
+    }
+};
+
+}
+
+extern "C" void lb_parallel_for(int64_t Lower, int64_t Upper, int64_t Step, lb_body_fn Body, void *Ctx)
+{
+    if (Upper <= Lower)
+        return;
+    int64_t Iterations = (Upper - Lower - 1) / Step + 1;
+    if (InParallelLoop || Iterations == 1 || ThreadPool::get().size() == 1) {
+        for (int64_t I = 0; I < Iterations; I++)
+            Body(Lower + I * Step, Ctx);
+        return;
+    }
+    struct Guard
+    {
+        Guard() { InParallelLoop = true; }
+        ~Guard() { InParallelLoop = false; }
+    } G;
+    ThreadPool::get().run(Lower, Step, Iterations, Body, Ctx);
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef LOOPBLOCKINGRT_H
+#define LOOPBLOCKINGRT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Body of a parallel blocking loop, outlined by the pass: runs the block starting at iteration IV.
+// Ctx points to the values the body needs from the enclosing function.
+typedef void (*lb_body_fn)(int64_t IV, void *Ctx);
+
+// Runs Body(IV, Ctx) for IV = Lower, Lower + Step, ... while IV < Upper, in any order and in parallel.
+// Returns when all the iterations are complete. Step must be positive.
+// The number of threads is given by the LB_NUM_THREADS environment variable (default: hardware threads).
+void lb_parallel_for(int64_t Lower, int64_t Upper, int64_t Step, lb_body_fn Body, void *Ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+; 2D Gauss-Seidel: A[i][j] = 0.2 * (A[i-1][j] + A[i][j-1] + A[i-1][j+1] + A[i][j+1] + A[i+1][j]), with dependence
+; distances (1, 0), (0, 1) and (1, -1). The nest is blocked only after skewing j by i; the blocks, visited in order or by
+; anti-diagonals (-blk-wavefront, in parallel with -blk-parallel), must compute the same values as the original nest
+; (@gs_ref, optnone).
+; RUN: %opt -passes='function(custom-loopblocking)' -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=REMARK
+; RUN: %opt -passes='function(custom-loopblocking)' %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-sizes=7,5 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-sizes=7,5 -blk-full-tiles=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-wavefront %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-wavefront -blk-sizes=7,5 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-wavefront -blk-parallel -S %s | FileCheck %s --check-prefix=PARALLEL
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-wavefront -blk-parallel %s | %lli --dlopen=%rt | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-wavefront -blk-parallel -blk-sizes=11,3 %s | LB_NUM_THREADS=4 %lli --dlopen=%rt | FileCheck %s
+; Without skewing the nest is left alone
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-skew=false -pass-remarks-missed=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=NOSKEW
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-skew=false %s | %lli | FileCheck %s
+
+; REMARK: remark: {{.*}} blocked loop nest of depth 2 with factors L1: {{[0-9]+ [0-9]+}}, skewed
+; CHECK: gs ok
+; PARALLEL-LABEL: define void @gs(
+; PARALLEL: call void @lb_parallel_for(i64 %{{.*}}, i64 %{{.*}}, i64 1, void (i64, i8*)* @gs.block.par, i8* %{{.*}})
+; NOSKEW: remark: {{.*}} loop nest not blocked: dependences prevent blocking the nest, and skewing is disabled
+
+@A = global [10000 x double] zeroinitializer
+@R = global [10000 x double] zeroinitializer
+@ok = private constant [6 x i8] c"gs ok\00"
+@differs = private constant [11 x i8] c"gs differs\00"
+
+declare i32 @puts(i8*)
+
+define void @gs([100 x double]* noalias %A) {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 1, %entry ], [ %i.next, %i.latch ]
+  %i.prev = add nsw i64 %i, -1
+  %i.succ = add nuw nsw i64 %i, 1
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 1, %i.header ], [ %j.next, %j.header ]
+  %j.prev = add nsw i64 %j, -1
+  %j.succ = add nuw nsw i64 %j, 1
+  %n.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.prev, i64 %j
+  %n = load double, double* %n.p, align 8
+  %w.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j.prev
+  %w = load double, double* %w.p, align 8
+  %ne.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.prev, i64 %j.succ
+  %ne = load double, double* %ne.p, align 8
+  %e.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j.succ
+  %e = load double, double* %e.p, align 8
+  %s.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.succ, i64 %j
+  %s = load double, double* %s.p, align 8
+  %sum1 = fadd double %n, %w
+  %sum2 = fadd double %sum1, %ne
+  %sum3 = fadd double %sum2, %e
+  %sum4 = fadd double %sum3, %s
+  %avg = fmul double %sum4, 2.000000e-01
+  %c.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j
+  store double %avg, double* %c.p, align 8
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 99
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 99
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+define void @gs_ref([100 x double]* noalias %A) #0 {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 1, %entry ], [ %i.next, %i.latch ]
+  %i.prev = add nsw i64 %i, -1
+  %i.succ = add nuw nsw i64 %i, 1
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 1, %i.header ], [ %j.next, %j.header ]
+  %j.prev = add nsw i64 %j, -1
+  %j.succ = add nuw nsw i64 %j, 1
+  %n.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.prev, i64 %j
+  %n = load double, double* %n.p, align 8
+  %w.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j.prev
+  %w = load double, double* %w.p, align 8
+  %ne.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.prev, i64 %j.succ
+  %ne = load double, double* %ne.p, align 8
+  %e.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j.succ
+  %e = load double, double* %e.p, align 8
+  %s.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i.succ, i64 %j
+  %s = load double, double* %s.p, align 8
+  %sum1 = fadd double %n, %w
+  %sum2 = fadd double %sum1, %ne
+  %sum3 = fadd double %sum2, %e
+  %sum4 = fadd double %sum3, %s
+  %avg = fmul double %sum4, 2.000000e-01
+  %c.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %j
+  store double %avg, double* %c.p, align 8
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 99
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 99
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+; Every point is computed with the same operations in the same order: the results are equal bit by bit
+define i32 @main() #0 {
+entry:
+  %a = getelementptr [10000 x double], [10000 x double]* @A, i64 0, i64 0
+  %r = getelementptr [10000 x double], [10000 x double]* @R, i64 0, i64 0
+  br label %init
+
+init:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %init ]
+  %i7 = mul i64 %i, 7
+  %ra = urem i64 %i7, 13
+  %fa = uitofp i64 %ra to double
+  %pa = getelementptr double, double* %a, i64 %i
+  store double %fa, double* %pa
+  %pr = getelementptr double, double* %r, i64 %i
+  store double %fa, double* %pr
+  %i.next = add i64 %i, 1
+  %init.done = icmp eq i64 %i.next, 10000
+  br i1 %init.done, label %run, label %init
+
+run:
+  %a2 = bitcast double* %a to [100 x double]*
+  %r2 = bitcast double* %r to [100 x double]*
+  call void @gs([100 x double]* %a2)
+  call void @gs_ref([100 x double]* %r2)
+  br label %compare
+
+compare:
+  %j = phi i64 [ 0, %run ], [ %j.next, %compare.next ]
+  %qa = getelementptr double, double* %a, i64 %j
+  %va = load double, double* %qa
+  %qr = getelementptr double, double* %r, i64 %j
+  %vr = load double, double* %qr
+  %diff = fcmp une double %va, %vr
+  br i1 %diff, label %fail, label %compare.next
+
+compare.next:
+  %j.next = add i64 %j, 1
+  %compare.done = icmp eq i64 %j.next, 10000
+  br i1 %compare.done, label %pass, label %compare
+
+pass:
+  %okmsg = getelementptr [6 x i8], [6 x i8]* @ok, i64 0, i64 0
+  call i32 @puts(i8* %okmsg)
+  ret i32 0
+
+fail:
+  %failmsg = getelementptr [11 x i8], [11 x i8]* @differs, i64 0, i64 0
+  call i32 @puts(i8* %failmsg)
+  ret i32 1
+}
+
+attributes #0 = { noinline optnone }
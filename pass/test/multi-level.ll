@@ -0,0 +1,178 @@
+; Blocking GEMM for two and three cache levels: the blocks of a level are made of whole blocks of the level below, and
+; the blocked nest must compute the same values as the original one (@gemm_ref, optnone), also with factors that do not
+; divide the trip counts or each other's multiples, without the copy for full blocks, and with the outermost blocking
+; loop run in parallel.
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=2 -blk-cache-sizes=4096,65536 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=TWO
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=2 -blk-cache-sizes=4096,65536 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=2 -blk-cache-sizes=4096,65536 -blk-full-tiles=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=2 -blk-cache-sizes=4096,65536 -blk-parallel %s | LB_NUM_THREADS=3 %lli --dlopen=%rt | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=THREE
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -blk-reorder=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -blk-sizes=7,9,5 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=ODD
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -blk-sizes=7,9,5 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -blk-sizes=7,9,5 -blk-full-tiles=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='loop(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=THREE
+; RUN: %opt -passes='loop(custom-loopblocking)' -blk-levels=3 -blk-cache-sizes=2048,16384,131072 %s | %lli | FileCheck %s
+
+; CHECK: gemm ok
+; TWO: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 8 16 8; L2: 32 128 32
+; THREE: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 8 8 8; L2: 16 32 16; L3: 64 64 64
+; ODD: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 7 9 5; L2: 14 36 20; L3: 56 72 80
+
+@A = global [10000 x double] zeroinitializer
+@B = global [10000 x double] zeroinitializer
+@C = global [10000 x double] zeroinitializer
+@R = global [10000 x double] zeroinitializer
+@ok = private constant [8 x i8] c"gemm ok\00"
+@differs = private constant [13 x i8] c"gemm differs\00"
+
+declare i32 @puts(i8*)
+
+define void @gemm([100 x double]* noalias %A, [100 x double]* noalias %B, [100 x double]* noalias %C) {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.p = getelementptr inbounds [100 x double], [100 x double]* %C, i64 %i, i64 %j
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [100 x double], [100 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 100
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 100
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 100
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+define void @gemm_ref([100 x double]* noalias %A, [100 x double]* noalias %B, [100 x double]* noalias %C) #0 {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.p = getelementptr inbounds [100 x double], [100 x double]* %C, i64 %i, i64 %j
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.p = getelementptr inbounds [100 x double], [100 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [100 x double], [100 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 100
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 100
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 100
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+; Small integers: the products and sums are exact in any order
+define i32 @main() #0 {
+entry:
+  %a = getelementptr [10000 x double], [10000 x double]* @A, i64 0, i64 0
+  %b = getelementptr [10000 x double], [10000 x double]* @B, i64 0, i64 0
+  %c = getelementptr [10000 x double], [10000 x double]* @C, i64 0, i64 0
+  %r = getelementptr [10000 x double], [10000 x double]* @R, i64 0, i64 0
+  br label %init
+
+init:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %init ]
+  %i7 = mul i64 %i, 7
+  %ra = urem i64 %i7, 13
+  %fa = uitofp i64 %ra to double
+  %pa = getelementptr double, double* %a, i64 %i
+  store double %fa, double* %pa
+  %rb = urem i64 %i, 5
+  %fb = uitofp i64 %rb to double
+  %pb = getelementptr double, double* %b, i64 %i
+  store double %fb, double* %pb
+  %rc = urem i64 %i, 3
+  %fc = uitofp i64 %rc to double
+  %pc = getelementptr double, double* %c, i64 %i
+  store double %fc, double* %pc
+  %pr = getelementptr double, double* %r, i64 %i
+  store double %fc, double* %pr
+  %i.next = add i64 %i, 1
+  %init.done = icmp eq i64 %i.next, 10000
+  br i1 %init.done, label %run, label %init
+
+run:
+  %a2 = bitcast double* %a to [100 x double]*
+  %b2 = bitcast double* %b to [100 x double]*
+  %c2 = bitcast double* %c to [100 x double]*
+  %r2 = bitcast double* %r to [100 x double]*
+  call void @gemm([100 x double]* %a2, [100 x double]* %b2, [100 x double]* %c2)
+  call void @gemm_ref([100 x double]* %a2, [100 x double]* %b2, [100 x double]* %r2)
+  br label %compare
+
+compare:
+  %j = phi i64 [ 0, %run ], [ %j.next, %compare.next ]
+  %qc = getelementptr double, double* %c, i64 %j
+  %vc = load double, double* %qc
+  %qr = getelementptr double, double* %r, i64 %j
+  %vr = load double, double* %qr
+  %diff = fcmp une double %vc, %vr
+  br i1 %diff, label %fail, label %compare.next
+
+compare.next:
+  %j.next = add i64 %j, 1
+  %compare.done = icmp eq i64 %j.next, 10000
+  br i1 %compare.done, label %pass, label %compare
+
+pass:
+  %okmsg = getelementptr [8 x i8], [8 x i8]* @ok, i64 0, i64 0
+  call i32 @puts(i8* %okmsg)
+  ret i32 0
+
+fail:
+  %failmsg = getelementptr [13 x i8], [13 x i8]* @differs, i64 0, i64 0
+  call i32 @puts(i8* %failmsg)
+  ret i32 1
+}
+
+attributes #0 = { noinline optnone }
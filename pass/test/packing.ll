@@ -0,0 +1,267 @@
+; Packing of GEMM on 128 x 128 arrays, whose rows are 1 KiB apart: with an 8 KiB L1 every row of a block maps to the
+; same cache sets, and the blocks of A, B and C are copied to buffers. @gemm runs i, j, k, @gemm_kij runs k, i, j, whose
+; outermost loop carries the sums into C. The blocked nests must compute the same values as the original ones (the
+; _ref copies, optnone), also with odd factors and without the copy of the nest for full blocks.
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=PACK
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-sizes=15,17,15 -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=ODD
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-sizes=15,17,15 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-sizes=15,17,15 -blk-full-tiles=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-full-tiles=false -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=PACK
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-full-tiles=false %s | %lli | FileCheck %s
+; With -blk-parallel the blocks of i of @gemm run in parallel and would share the buffers: @gemm is not packed. The
+; outermost blocking loop of @gemm_kij, and every blocking loop in the loop nest pass, which does not outline, stay
+; sequential: they are packed.
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-parallel -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=PARALLEL
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-parallel %s | %lli --dlopen=%rt | FileCheck %s
+; RUN: %opt -passes='loop(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-parallel -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=PACK
+; RUN: %opt -passes='loop(custom-loopblocking)' -blk-pack -blk-cache-sizes=8192 -blk-parallel %s | %lli | FileCheck %s
+
+; CHECK: gemm ok
+; PACK: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 16 16 16, packing 3 arrays
+; PACK: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 16 16 16, packing 3 arrays
+; ODD: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 15 17 15, packing 3 arrays
+; ODD: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 15 17 15, packing 3 arrays
+; PARALLEL: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 16 16 16{{$}}
+; PARALLEL: remark: {{.*}} blocked loop nest of depth 3 with factors L1: 16 16 16, packing 3 arrays
+
+@A = global [16384 x double] zeroinitializer
+@B = global [16384 x double] zeroinitializer
+@C = global [16384 x double] zeroinitializer
+@R = global [16384 x double] zeroinitializer
+@ok = private constant [8 x i8] c"gemm ok\00"
+@differs = private constant [13 x i8] c"gemm differs\00"
+
+declare i32 @puts(i8*)
+
+define void @gemm([128 x double]* noalias %A, [128 x double]* noalias %B, [128 x double]* noalias %C) {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.p = getelementptr inbounds [128 x double], [128 x double]* %C, i64 %i, i64 %j
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.p = getelementptr inbounds [128 x double], [128 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [128 x double], [128 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 128
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 128
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 128
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+define void @gemm_ref([128 x double]* noalias %A, [128 x double]* noalias %B, [128 x double]* noalias %C) #0 {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.p = getelementptr inbounds [128 x double], [128 x double]* %C, i64 %i, i64 %j
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.p = getelementptr inbounds [128 x double], [128 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [128 x double], [128 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 128
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 128
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 128
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
+
+define void @gemm_kij([128 x double]* noalias %A, [128 x double]* noalias %B, [128 x double]* noalias %C) {
+entry:
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %entry ], [ %k.next, %k.latch ]
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %k.header ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.header ]
+  %a.p = getelementptr inbounds [128 x double], [128 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [128 x double], [128 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c.p = getelementptr inbounds [128 x double], [128 x double]* %C, i64 %i, i64 %j
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 128
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 128
+  br i1 %i.cmp, label %i.header, label %k.latch
+
+k.latch:
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 128
+  br i1 %k.cmp, label %k.header, label %exit
+
+exit:
+  ret void
+}
+
+define void @gemm_kij_ref([128 x double]* noalias %A, [128 x double]* noalias %B, [128 x double]* noalias %C) #0 {
+entry:
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %entry ], [ %k.next, %k.latch ]
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %k.header ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.header ]
+  %a.p = getelementptr inbounds [128 x double], [128 x double]* %A, i64 %i, i64 %k
+  %a = load double, double* %a.p, align 8
+  %b.p = getelementptr inbounds [128 x double], [128 x double]* %B, i64 %k, i64 %j
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c.p = getelementptr inbounds [128 x double], [128 x double]* %C, i64 %i, i64 %j
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 128
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 128
+  br i1 %i.cmp, label %i.header, label %k.latch
+
+k.latch:
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 128
+  br i1 %k.cmp, label %k.header, label %exit
+
+exit:
+  ret void
+}
+
+; Both kernels add A * B to C. Small integers: the products and sums are exact in any order
+define i32 @main() #0 {
+entry:
+  %a = getelementptr [16384 x double], [16384 x double]* @A, i64 0, i64 0
+  %b = getelementptr [16384 x double], [16384 x double]* @B, i64 0, i64 0
+  %c = getelementptr [16384 x double], [16384 x double]* @C, i64 0, i64 0
+  %r = getelementptr [16384 x double], [16384 x double]* @R, i64 0, i64 0
+  br label %init
+
+init:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %init ]
+  %i7 = mul i64 %i, 7
+  %ra = urem i64 %i7, 13
+  %fa = uitofp i64 %ra to double
+  %pa = getelementptr double, double* %a, i64 %i
+  store double %fa, double* %pa
+  %rb = urem i64 %i, 5
+  %fb = uitofp i64 %rb to double
+  %pb = getelementptr double, double* %b, i64 %i
+  store double %fb, double* %pb
+  %rc = urem i64 %i, 3
+  %fc = uitofp i64 %rc to double
+  %pc = getelementptr double, double* %c, i64 %i
+  store double %fc, double* %pc
+  %pr = getelementptr double, double* %r, i64 %i
+  store double %fc, double* %pr
+  %i.next = add i64 %i, 1
+  %init.done = icmp eq i64 %i.next, 16384
+  br i1 %init.done, label %run, label %init
+
+run:
+  %a2 = bitcast double* %a to [128 x double]*
+  %b2 = bitcast double* %b to [128 x double]*
+  %c2 = bitcast double* %c to [128 x double]*
+  %r2 = bitcast double* %r to [128 x double]*
+  call void @gemm([128 x double]* %a2, [128 x double]* %b2, [128 x double]* %c2)
+  call void @gemm_ref([128 x double]* %a2, [128 x double]* %b2, [128 x double]* %r2)
+  call void @gemm_kij([128 x double]* %a2, [128 x double]* %b2, [128 x double]* %c2)
+  call void @gemm_kij_ref([128 x double]* %a2, [128 x double]* %b2, [128 x double]* %r2)
+  br label %compare
+
+compare:
+  %j = phi i64 [ 0, %run ], [ %j.next, %compare.next ]
+  %qc = getelementptr double, double* %c, i64 %j
+  %vc = load double, double* %qc
+  %qr = getelementptr double, double* %r, i64 %j
+  %vr = load double, double* %qr
+  %diff = fcmp une double %vc, %vr
+  br i1 %diff, label %fail, label %compare.next
+
+compare.next:
+  %j.next = add i64 %j, 1
+  %compare.done = icmp eq i64 %j.next, 16384
+  br i1 %compare.done, label %pass, label %compare
+
+pass:
+  %okmsg = getelementptr [8 x i8], [8 x i8]* @ok, i64 0, i64 0
+  call i32 @puts(i8* %okmsg)
+  ret i32 0
+
+fail:
+  %failmsg = getelementptr [13 x i8], [13 x i8]* @differs, i64 0, i64 0
+  call i32 @puts(i8* %failmsg)
+  ret i32 1
+}
+
+attributes #0 = { noinline optnone }
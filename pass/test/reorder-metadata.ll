@@ -0,0 +1,75 @@
+; GEMM in k, j, i order, with the profiled trip counts of its loops (i 48, j 256, k 128) and a vectorization width
+; on the innermost one: the loops inside the blocks are reordered to i, k, j. The I-th loop then runs the iterations
+; of another one, and takes its attributes and its estimated trip count (the smaller of the trip count and the factor).
+; The target has a cache line size, which CacheCost needs to rank the loops.
+; RUN: %opt -passes='function(loop-simplify,lcssa,custom-loopblocking)' -pass-remarks=loop-blocking -S %s 2>&1 | FileCheck %s
+
+; CHECK: remark: {{.*}} factors L1: 32 64 64, {{.*}} with the loops reordered
+; The loop of k runs i, the loop of j runs k and the loop of i runs j
+; CHECK-LABEL: {{^}}k.header:
+; CHECK: label %i.header, label %j.latch, !prof ![[J_PROF:[0-9]+]], !llvm.loop ![[J_ID:[0-9]+]]
+; CHECK: label %j.header, label %k.latch, !prof ![[K_PROF:[0-9]+]], !llvm.loop ![[K_ID:[0-9]+]]
+; CHECK: label %k.header, label %blocking.loop.latch.loopexit, !prof ![[I_PROF:[0-9]+]], !llvm.loop ![[I_ID:[0-9]+]]
+; CHECK-DAG: ![[J_PROF]] = !{!"branch_weights", i32 63, i32 1}
+; CHECK-DAG: ![[K_PROF]] = !{!"branch_weights", i32 31, i32 1}
+; CHECK-DAG: ![[I_PROF]] = !{!"branch_weights", i32 47, i32 1}
+; CHECK-DAG: ![[J_ID]] = distinct !{![[J_ID]], ![[NO_TILE:[0-9]+]]}
+; CHECK-DAG: ![[K_ID]] = distinct !{![[K_ID]], ![[NO_TILE]]}
+; CHECK-DAG: ![[I_ID]] = distinct !{![[I_ID]], ![[WIDTH:[0-9]+]], ![[NO_TILE]]}
+; CHECK-DAG: ![[WIDTH]] = !{!"llvm.loop.vectorize.width", i32 4}
+
+target triple = "powerpc64le-unknown-linux-gnu"
+
+define void @gemm(i64 %n, double* noalias %A, double* noalias %B, double* noalias %C) {
+entry:
+  %g = icmp sgt i64 %n, 0
+  br i1 %g, label %k.header, label %exit
+
+k.header:
+  %k = phi i64 [ 0, %entry ], [ %k.next, %k.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %k.header ], [ %j.next, %j.latch ]
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %j.header ], [ %i.next, %i.header ]
+  %in = mul nsw i64 %i, %n
+  %kn = mul nsw i64 %k, %n
+  %a.idx = add nsw i64 %in, %k
+  %a.p = getelementptr inbounds double, double* %A, i64 %a.idx
+  %a = load double, double* %a.p, align 8
+  %b.idx = add nsw i64 %kn, %j
+  %b.p = getelementptr inbounds double, double* %B, i64 %b.idx
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c.idx = add nsw i64 %in, %j
+  %c.p = getelementptr inbounds double, double* %C, i64 %c.idx
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, %n
+  br i1 %i.cmp, label %i.header, label %j.latch, !prof !2, !llvm.loop !0
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, %n
+  br i1 %j.cmp, label %j.header, label %k.latch, !prof !3
+
+k.latch:
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, %n
+  br i1 %k.cmp, label %k.header, label %exit, !prof !4
+
+exit:
+  ret void
+}
+
+!0 = distinct !{!0, !1}
+!1 = !{!"llvm.loop.vectorize.width", i32 4}
+
+!2 = !{!"branch_weights", i32 47, i32 1}
+!3 = !{!"branch_weights", i32 255, i32 1}
+!4 = !{!"branch_weights", i32 127, i32 1}
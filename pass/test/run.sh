@@ -0,0 +1,47 @@
+#!/bin/bash
+# Runs the tests in this directory, in the style of LLVM's lit: every "; RUN:" line of a test is a shell pipeline that
+# must succeed. Substitutions: %s is the test file, %t a temporary file for it, %opt runs opt with the pass loaded,
+# %lli runs lli, %rt is the shared runtime library (for lli --dlopen), %prepare is the canonicalization pipeline of the
+# benchmarks (bench/run.sh).
+# Usually run through "make check", which sets the tools; uses OPT, LLI, FILECHECK, PASS, RT, BUILD_DIR, and runs the
+# tests given as arguments or all of them.
+set -u
+
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+OPT=${OPT:-opt}
+LLI=${LLI:-lli}
+FILECHECK=${FILECHECK:-FileCheck}
+PASS=${PASS:-$TEST_DIR/../LoopBlocking.so}
+RT=${RT:-$TEST_DIR/../libLoopBlockingRT.so}
+BUILD_DIR=${BUILD_DIR:-$TEST_DIR/../obj/test}
+PREPARE="sroa,early-cse<memssa>,instcombine,simplifycfg,loop(loop-rotate),loop-simplify,lcssa"
+
+if [ $# -eq 0 ]; then
+    set -- "$TEST_DIR"/*.ll
+fi
+mkdir -p "$BUILD_DIR"
+failed=0
+for test in "$@"; do
+    name=$(basename "$test" .ll)
+    status=PASS
+    while IFS= read -r run; do
+        run=${run//%opt/$OPT -load=$PASS -load-pass-plugin=$PASS}
+        run=${run//%lli/$LLI}
+        run=${run//%rt/$RT}
+        run=${run//%prepare/$PREPARE}
+        run=${run//%s/$test}
+        run=${run//%t/$BUILD_DIR/$name.tmp}
+        run=${run//FileCheck/$FILECHECK}
+        if ! output=$(bash -o pipefail -c "$run" 2>&1); then
+            echo "$name: failed: $run"
+            echo "$output"
+            status=FAIL
+        fi
+    done < <(sed -n 's/^; RUN: //p' "$test")
+    echo "$status: $name"
+    if [ $status = FAIL ]; then
+        failed=$((failed + 1))
+    fi
+done
+echo "$failed of $# tests failed"
+[ $failed -eq 0 ]
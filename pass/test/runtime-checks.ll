@@ -0,0 +1,235 @@
+; GEMM on row-major arrays of n columns passed without noalias: the blocked nest runs only if the arrays do not overlap
+; and n is large enough for blocking to pay off, otherwise the original copy runs. Each call must compute the same
+; values as the original nest (@gemm_ref, optnone) with the same arguments: disjoint arrays, C overlapping A (C = A + 7),
+; C = A, and a trip count below the minimum for blocking.
+; RUN: %opt -passes='function(custom-loopblocking)' -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=REMARK
+; RUN: %opt -passes='function(custom-loopblocking)' %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-sizes=7,9,5 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-sizes=7,9,5 -blk-full-tiles=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='loop(custom-loopblocking)' -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=REMARK
+; RUN: %opt -passes='loop(custom-loopblocking)' %s | %lli | FileCheck %s
+; Without the checks the accesses to the arguments may overlap, and the nest is left alone
+; RUN: %opt -passes='function(custom-loopblocking)' -blk-runtime-checks=false -pass-remarks-missed=loop-blocking -disable-output %s 2>&1 | FileCheck %s --check-prefix=NOCHECKS
+
+; REMARK: remark: {{.*}} blocked loop nest of depth 3 with factors L1: {{[0-9]+ [0-9]+ [0-9]+}}, {{.*}}, under run-time checks
+; CHECK: disjoint ok
+; CHECK-NEXT: overlap ok
+; CHECK-NEXT: same ok
+; CHECK-NEXT: small ok
+; NOCHECKS: remark: {{.*}} loop nest not blocked: dependences prevent blocking the nest
+
+; The arrays have room for C = A + 7
+@A = global [10100 x double] zeroinitializer
+@B = global [10100 x double] zeroinitializer
+@C = global [10100 x double] zeroinitializer
+@RA = global [10100 x double] zeroinitializer
+@RB = global [10100 x double] zeroinitializer
+@RC = global [10100 x double] zeroinitializer
+@disjoint = private constant [9 x i8] c"disjoint\00"
+@overlap = private constant [8 x i8] c"overlap\00"
+@same = private constant [5 x i8] c"same\00"
+@small = private constant [6 x i8] c"small\00"
+@ok = private constant [7 x i8] c"%s ok\0A\00"
+@differs = private constant [12 x i8] c"%s differs\0A\00"
+
+declare i32 @printf(i8*, ...)
+
+define void @gemm(double* %A, double* %B, double* %C, i64 %n) {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %i.preheader, label %exit
+
+i.preheader:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %i.preheader ], [ %i.next, %i.latch ]
+  %i.row = mul nsw i64 %i, %n
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.idx = add nsw i64 %i.row, %j
+  %c.p = getelementptr inbounds double, double* %C, i64 %c.idx
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.idx = add nsw i64 %i.row, %k
+  %a.p = getelementptr inbounds double, double* %A, i64 %a.idx
+  %a = load double, double* %a.p, align 8
+  %k.row = mul nsw i64 %k, %n
+  %b.idx = add nsw i64 %k.row, %j
+  %b.p = getelementptr inbounds double, double* %B, i64 %b.idx
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, %n
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, %n
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, %n
+  br i1 %i.cmp, label %i.header, label %i.exit
+
+i.exit:
+  br label %exit
+
+exit:
+  ret void
+}
+
+define void @gemm_ref(double* %A, double* %B, double* %C, i64 %n) #0 {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %i.preheader, label %exit
+
+i.preheader:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %i.preheader ], [ %i.next, %i.latch ]
+  %i.row = mul nsw i64 %i, %n
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.idx = add nsw i64 %i.row, %j
+  %c.p = getelementptr inbounds double, double* %C, i64 %c.idx
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.idx = add nsw i64 %i.row, %k
+  %a.p = getelementptr inbounds double, double* %A, i64 %a.idx
+  %a = load double, double* %a.p, align 8
+  %k.row = mul nsw i64 %k, %n
+  %b.idx = add nsw i64 %k.row, %j
+  %b.p = getelementptr inbounds double, double* %B, i64 %b.idx
+  %b = load double, double* %b.p, align 8
+  %mul = fmul double %a, %b
+  %c = load double, double* %c.p, align 8
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, %n
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, %n
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, %n
+  br i1 %i.cmp, label %i.header, label %i.exit
+
+i.exit:
+  br label %exit
+
+exit:
+  ret void
+}
+
+define void @init(double* %p, i64 %mul, i64 %mod) #0 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %im = mul i64 %i, %mul
+  %r = urem i64 %im, %mod
+  %f = uitofp i64 %r to double
+  %q = getelementptr double, double* %p, i64 %i
+  store double %f, double* %q
+  %i.next = add i64 %i, 1
+  %done = icmp eq i64 %i.next, 10100
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; By their bits: in the overlapping case the values grow to infinity, and then to NaN
+define i1 @equal(double* %p.d, double* %q.d) #0 {
+entry:
+  %p = bitcast double* %p.d to i64*
+  %q = bitcast double* %q.d to i64*
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %next ]
+  %pi = getelementptr i64, i64* %p, i64 %i
+  %vp = load i64, i64* %pi
+  %qi = getelementptr i64, i64* %q, i64 %i
+  %vq = load i64, i64* %qi
+  %diff = icmp ne i64 %vp, %vq
+  br i1 %diff, label %exit, label %next
+
+next:
+  %i.next = add i64 %i, 1
+  %done = icmp eq i64 %i.next, 10100
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %eq = phi i1 [ false, %loop ], [ true, %next ]
+  ret i1 %eq
+}
+
+; Runs both versions on fresh copies of the arrays, C at offset %c.off of A (or of its own array if %c.own), and
+; compares all the arrays. Small integers: the products and sums are exact in any order.
+define void @check(i8* %name, i1 %c.own, i64 %c.off, i64 %n) #0 {
+entry:
+  %a = getelementptr [10100 x double], [10100 x double]* @A, i64 0, i64 0
+  %b = getelementptr [10100 x double], [10100 x double]* @B, i64 0, i64 0
+  %c = getelementptr [10100 x double], [10100 x double]* @C, i64 0, i64 0
+  %ra = getelementptr [10100 x double], [10100 x double]* @RA, i64 0, i64 0
+  %rb = getelementptr [10100 x double], [10100 x double]* @RB, i64 0, i64 0
+  %rc = getelementptr [10100 x double], [10100 x double]* @RC, i64 0, i64 0
+  call void @init(double* %a, i64 7, i64 13)
+  call void @init(double* %b, i64 1, i64 5)
+  call void @init(double* %c, i64 1, i64 3)
+  call void @init(double* %ra, i64 7, i64 13)
+  call void @init(double* %rb, i64 1, i64 5)
+  call void @init(double* %rc, i64 1, i64 3)
+  %c.base = select i1 %c.own, double* %c, double* %a
+  %rc.base = select i1 %c.own, double* %rc, double* %ra
+  %c.p = getelementptr double, double* %c.base, i64 %c.off
+  %rc.p = getelementptr double, double* %rc.base, i64 %c.off
+  call void @gemm(double* %a, double* %b, double* %c.p, i64 %n)
+  call void @gemm_ref(double* %ra, double* %rb, double* %rc.p, i64 %n)
+  %eq.a = call i1 @equal(double* %a, double* %ra)
+  %eq.b = call i1 @equal(double* %b, double* %rb)
+  %eq.c = call i1 @equal(double* %c, double* %rc)
+  %eq.ab = and i1 %eq.a, %eq.b
+  %eq = and i1 %eq.ab, %eq.c
+  %okmsg = getelementptr [7 x i8], [7 x i8]* @ok, i64 0, i64 0
+  %failmsg = getelementptr [12 x i8], [12 x i8]* @differs, i64 0, i64 0
+  %msg = select i1 %eq, i8* %okmsg, i8* %failmsg
+  call i32 (i8*, ...) @printf(i8* %msg, i8* %name)
+  ret void
+}
+
+define i32 @main() #0 {
+entry:
+  %disjoint = getelementptr [9 x i8], [9 x i8]* @disjoint, i64 0, i64 0
+  %overlap = getelementptr [8 x i8], [8 x i8]* @overlap, i64 0, i64 0
+  %same = getelementptr [5 x i8], [5 x i8]* @same, i64 0, i64 0
+  %small = getelementptr [6 x i8], [6 x i8]* @small, i64 0, i64 0
+  call void @check(i8* %disjoint, i1 true, i64 0, i64 100)
+  call void @check(i8* %overlap, i1 false, i64 7, i64 100)
+  call void @check(i8* %same, i1 false, i64 0, i64 100)
+  call void @check(i8* %small, i1 true, i64 0, i64 5)
+  ret i32 0
+}
+
+attributes #0 = { noinline optnone }
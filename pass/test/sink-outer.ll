@@ -0,0 +1,52 @@
+; GEMM with the rows of A and C computed in the header of the i loop, as written in C with row pointers:
+; prepareNest sinks them into the header of the j loop and then, since they are only used there, into the k loop.
+; The three loops must be blocked, not only i and j.
+; RUN: %opt -passes='function(custom-loopblocking)' -pass-remarks=loop-blocking -disable-output %s 2>&1 | FileCheck %s
+
+; CHECK: remark: {{.*}} blocked loop nest of depth 3 with factors L1: {{[0-9]+ [0-9]+ [0-9]+$}}
+
+define void @gemm(double* noalias %A, double* noalias %B, double* noalias %C) {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  %i.row = mul nsw i64 %i, 512
+  %row.a = getelementptr inbounds double, double* %A, i64 %i.row
+  %row.c = getelementptr inbounds double, double* %C, i64 %i.row
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.latch ]
+  %c.p = getelementptr inbounds double, double* %row.c, i64 %j
+  br label %k.header
+
+k.header:
+  %k = phi i64 [ 0, %j.header ], [ %k.next, %k.header ]
+  %a.p = getelementptr inbounds double, double* %row.a, i64 %k
+  %k.row = mul nsw i64 %k, 512
+  %b.idx = add nsw i64 %k.row, %j
+  %b.p = getelementptr inbounds double, double* %B, i64 %b.idx
+  %a = load double, double* %a.p, align 8
+  %b = load double, double* %b.p, align 8
+  %c = load double, double* %c.p, align 8
+  %mul = fmul double %a, %b
+  %add = fadd double %c, %mul
+  store double %add, double* %c.p, align 8
+  %k.next = add nuw nsw i64 %k, 1
+  %k.cmp = icmp slt i64 %k.next, 512
+  br i1 %k.cmp, label %k.header, label %j.latch
+
+j.latch:
+  %j.next = add nuw nsw i64 %j, 1
+  %j.cmp = icmp slt i64 %j.next, 512
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 512
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
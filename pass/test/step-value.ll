@@ -0,0 +1,34 @@
+; The IV of the inner loop is incremented with "sub %j, -1": SCEV knows the step is 1, but it is not an operand of the
+; increment, and Loop::LoopBounds has no step value for the loop. The nest has to be rejected, not crash the pass.
+; RUN: %opt -passes='function(custom-loopblocking)' -pass-remarks-missed=loop-blocking -disable-output %s 2>&1 | FileCheck %s
+
+; CHECK: remark: {{.*}} loop nest not blocked: the step of a loop of the nest is not a positive constant
+
+define void @add([1000 x double]* noalias %A, [1000 x double]* noalias %B) {
+entry:
+  br label %i.header
+
+i.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %i.latch ]
+  br label %j.header
+
+j.header:
+  %j = phi i64 [ 0, %i.header ], [ %j.next, %j.header ]
+  %a.p = getelementptr inbounds [1000 x double], [1000 x double]* %A, i64 %i, i64 %j
+  %b.p = getelementptr inbounds [1000 x double], [1000 x double]* %B, i64 %j, i64 %i
+  %b = load double, double* %b.p, align 8
+  %a = load double, double* %a.p, align 8
+  %add = fadd double %a, %b
+  store double %add, double* %a.p, align 8
+  %j.next = sub nsw i64 %j, -1
+  %j.cmp = icmp slt i64 %j.next, 1000
+  br i1 %j.cmp, label %j.header, label %i.latch
+
+i.latch:
+  %i.next = add nuw nsw i64 %i, 1
+  %i.cmp = icmp slt i64 %i.next, 1000
+  br i1 %i.cmp, label %i.header, label %exit
+
+exit:
+  ret void
+}
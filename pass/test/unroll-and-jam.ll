@@ -0,0 +1,352 @@
+; Unroll-and-jam of the full blocks of GEMM as clang emits it at -O0: the blocked nests must compute the same values as
+; the original one (@gemm_ref, optnone, left alone by the pass). With a bound unknown at compile time, loop-rotate leaves
+; the guard of each inner loop in the outer loop body, a shape UnrollAndJamLoop does not handle: the jam is skipped.
+; RUN: %opt -passes='function(%prepare,custom-loopblocking)' -blk-unroll-jam %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(%prepare,custom-loopblocking)' -blk-unroll-jam -blk-unroll-jam-f=2 %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(%prepare,custom-loopblocking)' -blk-unroll-jam -blk-reorder=false %s | %lli | FileCheck %s
+; RUN: %opt -passes='function(%prepare,custom-loopblocking)' -blk-unroll-jam -blk-runtime-checks=false %s | %lli | FileCheck %s
+; With a constant bound the loops have no guards and the full blocks of @gemm100 are jammed
+; RUN: %opt -passes='function(%prepare,custom-loopblocking)' -blk-unroll-jam -S %s | FileCheck %s --check-prefix=JAM
+
+; CHECK: gemm ok
+; JAM-LABEL: define void @gemm100(
+; JAM: %add.full.1 = fadd double
+
+@A = global [10000 x double] zeroinitializer
+@B = global [10000 x double] zeroinitializer
+@C = global [10000 x double] zeroinitializer
+@C100 = global [10000 x double] zeroinitializer
+@R = global [10000 x double] zeroinitializer
+@ok = private constant [8 x i8] c"gemm ok\00"
+@differs = private constant [13 x i8] c"gemm differs\00"
+
+declare i32 @puts(i8*)
+
+define void @gemm(i64 %n, double* noalias %A, double* noalias %B, double* noalias %C) {
+entry:
+  %n.addr = alloca i64, align 8
+  %i = alloca i64, align 8
+  %j = alloca i64, align 8
+  %k = alloca i64, align 8
+  store i64 %n, i64* %n.addr, align 4
+  store i64 0, i64* %i, align 4
+  br label %for.cond
+
+for.cond:                                         ; preds = %for.inc18, %entry
+  %0 = load i64, i64* %i, align 4
+  %1 = load i64, i64* %n.addr, align 4
+  %cmp = icmp slt i64 %0, %1
+  br i1 %cmp, label %for.body, label %for.end20
+
+for.body:                                         ; preds = %for.cond
+  store i64 0, i64* %j, align 4
+  br label %for.cond1
+
+for.cond1:                                        ; preds = %for.inc15, %for.body
+  %2 = load i64, i64* %j, align 4
+  %3 = load i64, i64* %n.addr, align 4
+  %cmp2 = icmp slt i64 %2, %3
+  br i1 %cmp2, label %for.body3, label %for.end17
+
+for.body3:                                        ; preds = %for.cond1
+  store i64 0, i64* %k, align 4
+  br label %for.cond4
+
+for.cond4:                                        ; preds = %for.inc, %for.body3
+  %4 = load i64, i64* %k, align 4
+  %5 = load i64, i64* %n.addr, align 4
+  %cmp5 = icmp slt i64 %4, %5
+  br i1 %cmp5, label %for.body6, label %for.end
+
+for.body6:                                        ; preds = %for.cond4
+  %ii = load i64, i64* %i, align 4
+  %kk = load i64, i64* %k, align 4
+  %jj = load i64, i64* %j, align 4
+  %nn = load i64, i64* %n.addr, align 4
+  %m1 = mul nsw i64 %ii, %nn
+  %a1 = getelementptr inbounds double, double* %A, i64 %m1
+  %a2 = getelementptr inbounds double, double* %a1, i64 %kk
+  %av = load double, double* %a2, align 8
+  %m2 = mul nsw i64 %kk, %nn
+  %b1 = getelementptr inbounds double, double* %B, i64 %m2
+  %b2 = getelementptr inbounds double, double* %b1, i64 %jj
+  %bv = load double, double* %b2, align 8
+  %mul = fmul double %av, %bv
+  %m3 = mul nsw i64 %ii, %nn
+  %c1 = getelementptr inbounds double, double* %C, i64 %m3
+  %c2 = getelementptr inbounds double, double* %c1, i64 %jj
+  %cv = load double, double* %c2, align 8
+  %add = fadd double %cv, %mul
+  store double %add, double* %c2, align 8
+  br label %for.inc
+
+for.inc:                                          ; preds = %for.body6
+  %6 = load i64, i64* %k, align 4
+  %inc = add nsw i64 %6, 1
+  store i64 %inc, i64* %k, align 4
+  br label %for.cond4
+
+for.end:                                          ; preds = %for.cond4
+  br label %for.inc15
+
+for.inc15:                                        ; preds = %for.end
+  %7 = load i64, i64* %j, align 4
+  %inc16 = add nsw i64 %7, 1
+  store i64 %inc16, i64* %j, align 4
+  br label %for.cond1
+
+for.end17:                                        ; preds = %for.cond1
+  br label %for.inc18
+
+for.inc18:                                        ; preds = %for.end17
+  %8 = load i64, i64* %i, align 4
+  %inc19 = add nsw i64 %8, 1
+  store i64 %inc19, i64* %i, align 4
+  br label %for.cond
+
+for.end20:                                        ; preds = %for.cond
+  ret void
+}
+
+define void @gemm100(i64 %n, double* noalias %A, double* noalias %B, double* noalias %C) {
+entry:
+  %n.addr = alloca i64, align 8
+  %i = alloca i64, align 8
+  %j = alloca i64, align 8
+  %k = alloca i64, align 8
+  store i64 %n, i64* %n.addr, align 4
+  store i64 0, i64* %i, align 4
+  br label %for.cond
+
+for.cond:                                         ; preds = %for.inc18, %entry
+  %0 = load i64, i64* %i, align 4
+  %1 = load i64, i64* %n.addr, align 4
+  %cmp = icmp slt i64 %0, 100
+  br i1 %cmp, label %for.body, label %for.end20
+
+for.body:                                         ; preds = %for.cond
+  store i64 0, i64* %j, align 4
+  br label %for.cond1
+
+for.cond1:                                        ; preds = %for.inc15, %for.body
+  %2 = load i64, i64* %j, align 4
+  %3 = load i64, i64* %n.addr, align 4
+  %cmp2 = icmp slt i64 %2, 100
+  br i1 %cmp2, label %for.body3, label %for.end17
+
+for.body3:                                        ; preds = %for.cond1
+  store i64 0, i64* %k, align 4
+  br label %for.cond4
+
+for.cond4:                                        ; preds = %for.inc, %for.body3
+  %4 = load i64, i64* %k, align 4
+  %5 = load i64, i64* %n.addr, align 4
+  %cmp5 = icmp slt i64 %4, 100
+  br i1 %cmp5, label %for.body6, label %for.end
+
+for.body6:                                        ; preds = %for.cond4
+  %ii = load i64, i64* %i, align 4
+  %kk = load i64, i64* %k, align 4
+  %jj = load i64, i64* %j, align 4
+  %nn = add i64 0, 100
+  %m1 = mul nsw i64 %ii, %nn
+  %a1 = getelementptr inbounds double, double* %A, i64 %m1
+  %a2 = getelementptr inbounds double, double* %a1, i64 %kk
+  %av = load double, double* %a2, align 8
+  %m2 = mul nsw i64 %kk, %nn
+  %b1 = getelementptr inbounds double, double* %B, i64 %m2
+  %b2 = getelementptr inbounds double, double* %b1, i64 %jj
+  %bv = load double, double* %b2, align 8
+  %mul = fmul double %av, %bv
+  %m3 = mul nsw i64 %ii, %nn
+  %c1 = getelementptr inbounds double, double* %C, i64 %m3
+  %c2 = getelementptr inbounds double, double* %c1, i64 %jj
+  %cv = load double, double* %c2, align 8
+  %add = fadd double %cv, %mul
+  store double %add, double* %c2, align 8
+  br label %for.inc
+
+for.inc:                                          ; preds = %for.body6
+  %6 = load i64, i64* %k, align 4
+  %inc = add nsw i64 %6, 1
+  store i64 %inc, i64* %k, align 4
+  br label %for.cond4
+
+for.end:                                          ; preds = %for.cond4
+  br label %for.inc15
+
+for.inc15:                                        ; preds = %for.end
+  %7 = load i64, i64* %j, align 4
+  %inc16 = add nsw i64 %7, 1
+  store i64 %inc16, i64* %j, align 4
+  br label %for.cond1
+
+for.end17:                                        ; preds = %for.cond1
+  br label %for.inc18
+
+for.inc18:                                        ; preds = %for.end17
+  %8 = load i64, i64* %i, align 4
+  %inc19 = add nsw i64 %8, 1
+  store i64 %inc19, i64* %i, align 4
+  br label %for.cond
+
+for.end20:                                        ; preds = %for.cond
+  ret void
+}
+
+define void @gemm_ref(i64 %n, double* noalias %A, double* noalias %B, double* noalias %C) #0 {
+entry:
+  %n.addr = alloca i64, align 8
+  %i = alloca i64, align 8
+  %j = alloca i64, align 8
+  %k = alloca i64, align 8
+  store i64 %n, i64* %n.addr, align 4
+  store i64 0, i64* %i, align 4
+  br label %for.cond
+
+for.cond:                                         ; preds = %for.inc18, %entry
+  %0 = load i64, i64* %i, align 4
+  %1 = load i64, i64* %n.addr, align 4
+  %cmp = icmp slt i64 %0, %1
+  br i1 %cmp, label %for.body, label %for.end20
+
+for.body:                                         ; preds = %for.cond
+  store i64 0, i64* %j, align 4
+  br label %for.cond1
+
+for.cond1:                                        ; preds = %for.inc15, %for.body
+  %2 = load i64, i64* %j, align 4
+  %3 = load i64, i64* %n.addr, align 4
+  %cmp2 = icmp slt i64 %2, %3
+  br i1 %cmp2, label %for.body3, label %for.end17
+
+for.body3:                                        ; preds = %for.cond1
+  store i64 0, i64* %k, align 4
+  br label %for.cond4
+
+for.cond4:                                        ; preds = %for.inc, %for.body3
+  %4 = load i64, i64* %k, align 4
+  %5 = load i64, i64* %n.addr, align 4
+  %cmp5 = icmp slt i64 %4, %5
+  br i1 %cmp5, label %for.body6, label %for.end
+
+for.body6:                                        ; preds = %for.cond4
+  %ii = load i64, i64* %i, align 4
+  %kk = load i64, i64* %k, align 4
+  %jj = load i64, i64* %j, align 4
+  %nn = load i64, i64* %n.addr, align 4
+  %m1 = mul nsw i64 %ii, %nn
+  %a1 = getelementptr inbounds double, double* %A, i64 %m1
+  %a2 = getelementptr inbounds double, double* %a1, i64 %kk
+  %av = load double, double* %a2, align 8
+  %m2 = mul nsw i64 %kk, %nn
+  %b1 = getelementptr inbounds double, double* %B, i64 %m2
+  %b2 = getelementptr inbounds double, double* %b1, i64 %jj
+  %bv = load double, double* %b2, align 8
+  %mul = fmul double %av, %bv
+  %m3 = mul nsw i64 %ii, %nn
+  %c1 = getelementptr inbounds double, double* %C, i64 %m3
+  %c2 = getelementptr inbounds double, double* %c1, i64 %jj
+  %cv = load double, double* %c2, align 8
+  %add = fadd double %cv, %mul
+  store double %add, double* %c2, align 8
+  br label %for.inc
+
+for.inc:                                          ; preds = %for.body6
+  %6 = load i64, i64* %k, align 4
+  %inc = add nsw i64 %6, 1
+  store i64 %inc, i64* %k, align 4
+  br label %for.cond4
+
+for.end:                                          ; preds = %for.cond4
+  br label %for.inc15
+
+for.inc15:                                        ; preds = %for.end
+  %7 = load i64, i64* %j, align 4
+  %inc16 = add nsw i64 %7, 1
+  store i64 %inc16, i64* %j, align 4
+  br label %for.cond1
+
+for.end17:                                        ; preds = %for.cond1
+  br label %for.inc18
+
+for.inc18:                                        ; preds = %for.end17
+  %8 = load i64, i64* %i, align 4
+  %inc19 = add nsw i64 %8, 1
+  store i64 %inc19, i64* %i, align 4
+  br label %for.cond
+
+for.end20:                                        ; preds = %for.cond
+  ret void
+}
+
+; Small integers: the products and sums are exact in any order
+define i32 @main() #0 {
+entry:
+  %a = getelementptr [10000 x double], [10000 x double]* @A, i64 0, i64 0
+  %b = getelementptr [10000 x double], [10000 x double]* @B, i64 0, i64 0
+  %c = getelementptr [10000 x double], [10000 x double]* @C, i64 0, i64 0
+  %c100 = getelementptr [10000 x double], [10000 x double]* @C100, i64 0, i64 0
+  %r = getelementptr [10000 x double], [10000 x double]* @R, i64 0, i64 0
+  br label %init
+
+init:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %init ]
+  %i7 = mul i64 %i, 7
+  %ra = urem i64 %i7, 13
+  %fa = uitofp i64 %ra to double
+  %pa = getelementptr double, double* %a, i64 %i
+  store double %fa, double* %pa
+  %i5 = mul i64 %i, 5
+  %rb = urem i64 %i5, 11
+  %fb = uitofp i64 %rb to double
+  %pb = getelementptr double, double* %b, i64 %i
+  store double %fb, double* %pb
+  %rc = urem i64 %i, 3
+  %fc = uitofp i64 %rc to double
+  %pc = getelementptr double, double* %c, i64 %i
+  store double %fc, double* %pc
+  %pc100 = getelementptr double, double* %c100, i64 %i
+  store double %fc, double* %pc100
+  %pr = getelementptr double, double* %r, i64 %i
+  store double %fc, double* %pr
+  %i.next = add i64 %i, 1
+  %init.done = icmp eq i64 %i.next, 10000
+  br i1 %init.done, label %run, label %init
+
+run:
+  call void @gemm(i64 100, double* %a, double* %b, double* %c)
+  call void @gemm100(i64 100, double* %a, double* %b, double* %c100)
+  call void @gemm_ref(i64 100, double* %a, double* %b, double* %r)
+  br label %compare
+
+compare:
+  %j = phi i64 [ 0, %run ], [ %j.next, %compare.next ]
+  %qc = getelementptr double, double* %c, i64 %j
+  %vc = load double, double* %qc
+  %qc100 = getelementptr double, double* %c100, i64 %j
+  %vc100 = load double, double* %qc100
+  %qr = getelementptr double, double* %r, i64 %j
+  %vr = load double, double* %qr
+  %diff = fcmp une double %vc, %vr
+  %diff100 = fcmp une double %vc100, %vr
+  %any = or i1 %diff, %diff100
+  br i1 %any, label %fail, label %compare.next
+
+compare.next:
+  %j.next = add i64 %j, 1
+  %compare.done = icmp eq i64 %j.next, 10000
+  br i1 %compare.done, label %pass, label %compare
+
+pass:
+  %okmsg = getelementptr [8 x i8], [8 x i8]* @ok, i64 0, i64 0
+  call i32 @puts(i8* %okmsg)
+  ret i32 0
+
+fail:
+  %failmsg = getelementptr [13 x i8], [13 x i8]* @differs, i64 0, i64 0
+  call i32 @puts(i8* %failmsg)
+  ret i32 1
+}
+
+attributes #0 = { noinline optnone }